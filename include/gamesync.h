@@ -21,6 +21,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef _WIN32
     #define GAMESYNC_API __declspec(dllexport)
@@ -28,9 +29,14 @@
     #define GAMESYNC_API
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef uint32_t gs_Id;
 typedef uint8_t gs_TypeId;
 typedef double gs_Number;
+typedef uint64_t gs_Time; /* microseconds */
 
 typedef enum gs_SocketState {
     gs_nil,
@@ -46,13 +52,80 @@ typedef enum gs_SocketFlags {
     gs_read = 0x2,
 } gs_SocketFlags;
 
+typedef enum gs_ArrayType {
+    gs_f32 = 'f',
+    gs_f64 = 'd',
+    gs_i32 = 'i',
+} gs_ArrayType;
+
+/* Packed array of homogeneous numbers.  The elements are stored directly after
+ * the header, and the array is sent as one block.  Elements in [dirty_first,
+ * dirty_last) have changed since the array was last sent. */
+typedef struct gs_Array {
+    gs_ArrayType type;
+    int32_t len; /* number of elements */
+    int32_t dirty_first; 
+    int32_t dirty_last;
+    char* data; /* pointer to the elements */
+} gs_Array;
+
+/* A range of array elements received from the network, in wire byte order.
+ * The data points into the socket's read buffer. */
+typedef struct gs_ArrayPatch {
+    gs_ArrayType type;
+    int32_t len;
+    int32_t first;
+    int32_t count;
+    char const* data;
+} gs_ArrayPatch;
+
+#define gs_never UINT64_MAX
+
+/* Timer scheduled on the timer wheel.  Periodic timers run at a fixed rate:
+ * each deadline is one period after the previous deadline, not after the time
+ * the timer was collected, so that ticks don't drift. */
+typedef struct gs_Timer {
+    gs_Time deadline;
+    gs_Time period; /* zero for a one-shot timer */
+    int wheel; /* true if the timer is on the wheel, rather than expired */
+    struct gs_Timer* next;
+    struct gs_Timer** prev; /* pointer to the link that points to this timer */
+} gs_Timer;
+
+typedef enum gs_Transport {
+    gs_tcp,
+    gs_shm,
+} gs_Transport;
+
 #define gs_bufsize (1 << 15)
+#define gs_ringsize (1 << 17)
+
+/* Single-producer/single-consumer byte ring, shared between two processes on
+ * the same host.  'head' and 'tail' count the total bytes written and read,
+ * and are kept on separate cache lines. */
+typedef struct gs_Ring {
+    uint32_t head; /* written by the producer */
+    char pad1[60];
+    uint32_t tail; /* written by the consumer */
+    char pad2[60];
+    uint32_t closed; /* set when the producer closes its end */
+    char pad3[60];
+    char data[gs_ringsize];
+} gs_Ring;
 
 typedef struct gs_Socket {
-    int sd; /* socket file descriptor */
+    int sd; /* socket file descriptor, or eventfd for shared memory */
     int status; /* socket errno code */
     gs_SocketState state; /* socket state */
     gs_SocketFlags flags;
+    gs_Transport transport;
+    gs_Ring* tx; /* shared memory ring to the peer */
+    gs_Ring* rx; /* shared memory ring from the peer */
+    int peer; /* eventfd used to wake the peer */
+    int link; /* Unix socket to the peer; EOF means the peer exited */
+    struct gs_Socket* next; /* next socket in the free pool */
+    struct gs_Socket* pending; /* shm handshakes waiting for their fds */
+    int slot; /* index of the socket's pollfd in the last gs_poll, or -1 */
     char write_buf[gs_bufsize];
     char* write_ptr; /* pointer to end of area user has written */
     char* write_start; /* pointer to end of area socket has read */
@@ -67,12 +140,34 @@ typedef struct gs_Socket {
 /* UTILITY FUNCTIONS */
 GAMESYNC_API char const* gs_strerror(int error);
 
+/* PACKED ARRAYS */
+GAMESYNC_API size_t gs_array_elemsize(gs_ArrayType type);
+GAMESYNC_API size_t gs_array_size(gs_ArrayType type, int32_t len);
+GAMESYNC_API void gs_array_init(gs_Array* arr, gs_ArrayType type, int32_t len);
+GAMESYNC_API gs_Number gs_array_get(gs_Array const* arr, int32_t i);
+GAMESYNC_API void gs_array_set(gs_Array* arr, int32_t i, gs_Number num);
+GAMESYNC_API void gs_array_touch(gs_Array* arr);
+GAMESYNC_API void gs_array_clean(gs_Array* arr);
+GAMESYNC_API void gs_array_patch(gs_Array* arr, gs_ArrayPatch const* patch);
+
+/* TIMERS */
+GAMESYNC_API gs_Time gs_now();
+GAMESYNC_API gs_Timer* gs_timer(gs_Time delay, gs_Time period);
+GAMESYNC_API void gs_timer_cancel(gs_Timer* timer);
+GAMESYNC_API gs_Timer* gs_timer_expire();
+GAMESYNC_API gs_Time gs_timer_next(gs_Time now);
+GAMESYNC_API void gs_timer_advance(gs_Time now);
+
 /* CONNECTION MANAGEMENT */
+GAMESYNC_API void gs_reserve(int n);
 GAMESYNC_API gs_Socket* gs_socket();
 GAMESYNC_API void gs_close(gs_Socket* sd);
 GAMESYNC_API void gs_connect(gs_Socket* sd, char const* addr, uint16_t port);
-GAMESYNC_API void gs_listen(gs_Socket* sd, uint16_t port);
+GAMESYNC_API void gs_listen(gs_Socket* sd, uint16_t port, int backlog);
 GAMESYNC_API gs_Socket* gs_accept(gs_Socket* sd);
+GAMESYNC_API gs_Socket* gs_shm_socket();
+GAMESYNC_API void gs_shm_connect(gs_Socket* sd, char const* name);
+GAMESYNC_API void gs_shm_listen(gs_Socket* sd, char const* name, int backlog);
 GAMESYNC_API void gs_poll(gs_Socket** sds, int nsds, int wait);
 
 /* CONNECTION CHECKPOINTING */
@@ -84,16 +179,26 @@ GAMESYNC_API int gs_send_end(gs_Socket* sd);
 GAMESYNC_API int gs_send_ok(gs_Socket* sd, int32_t len);
 
 /* I/O CONTROL */
-GAMESYNC_API void gs_fetch(gs_Socket* sd);
+GAMESYNC_API int gs_fetch(gs_Socket* sd);
 GAMESYNC_API void gs_flush(gs_Socket* sd);
+GAMESYNC_API int32_t gs_send_space(gs_Socket* sd);
 
 /* SERIALIZATION/DESERIALIZATION */
 GAMESYNC_API char const* gs_recv_str(gs_Socket* sd);
+GAMESYNC_API char const* gs_recv_buf(gs_Socket* sd, int32_t* len);
 GAMESYNC_API gs_TypeId gs_recv_typeid(gs_Socket* sd);
 GAMESYNC_API gs_Id gs_recv_id(gs_Socket* sd);
 GAMESYNC_API gs_Number gs_recv_num(gs_Socket* sd);
+GAMESYNC_API int gs_recv_bool(gs_Socket* sd);
+GAMESYNC_API int gs_recv_array(gs_Socket* sd, gs_ArrayPatch* patch);
 GAMESYNC_API int gs_send_str(gs_Socket* sd, char const* str);
+GAMESYNC_API int gs_send_buf(gs_Socket* sd, char const* buf, int32_t len);
 GAMESYNC_API int gs_send_typeid(gs_Socket* sd, gs_TypeId id);
 GAMESYNC_API int gs_send_id(gs_Socket* sd, gs_Id id);
 GAMESYNC_API int gs_send_num(gs_Socket* sd, gs_Number num);
+GAMESYNC_API int gs_send_bool(gs_Socket* sd, int val);
+GAMESYNC_API int gs_send_array(gs_Socket* sd, gs_Array const* arr, int32_t first, int32_t count);
 
+#ifdef __cplusplus
+}
+#endif
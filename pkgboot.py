@@ -6,6 +6,7 @@ import shutil
 import subprocess
 import shlex
 import glob
+import fnmatch
 
 try:
     from SCons.Script import *
@@ -67,6 +68,7 @@ class Package:
     kind = 'lib'
     frameworks = []
     assets = []
+    posix_only = [] # Tools and tests that aren't built on Windows
 
     def __init__(self):
         # Initializes a package, and sets up an SCons build environment given
@@ -89,6 +91,14 @@ class Package:
         elif type(lib.platforms) == str:
             return self.env['PLATFORM'] == lib.platforms
 
+    def _src_is_valid_for_platform(self, path):
+        # Tools and tests that use POSIX APIs (fork, waitpid, ...) are skipped
+        # on Windows
+        if self.env['PLATFORM'] != 'win32':
+            return True
+        path = path.replace('\\', '/')
+        return not any(fnmatch.fnmatch(path, pattern) for pattern in self.posix_only)
+
     def _setup_assets(self):
         if len(self.assets) <= 0:
             return
@@ -142,6 +152,7 @@ class Package:
         self.includes.extend([
             'include',
             'src', 
+            'test', # Helpers shared by tests and tools
         ])
         self.src = []
 
@@ -250,8 +261,11 @@ class Package:
             else:
                 self.program = self.env.Program('bin/%s' % self.name, (self.lib, main))
         for tool in glob.glob('tools/*.cpp'):
+            if not self._src_is_valid_for_platform(tool):
+                continue
             name = os.path.splitext(os.path.basename(tool.lower()))[0]
-            self.env.Depends(tool, self.pch)
+            if self.use_pch:
+                self.env.Depends(tool, self.pch)
             tool = self.env.Program('bin/%s-%s' % (self.name, name), (self.lib, tool))
 
     def _setup_tests(self):
@@ -261,6 +275,8 @@ class Package:
         testenv = self.env.Clone()
         testenv.Append(LIBS=self.lib)
         for test in self.env.Glob('build/test/**.cpp'):
+            if not self._src_is_valid_for_platform('test/%s' % test.name):
+                continue
             if self.use_pch:
                 self.env.Depends(test, self.pch)
             name = test.name.replace('.cpp', '')
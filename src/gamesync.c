@@ -20,12 +20,17 @@
  * IN THE SOFTWARE.
  */
 
+#ifdef __linux__
+    #define _GNU_SOURCE /* for memfd_create */
+#endif
+
 #include "gamesync.h"
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 #include <math.h>
 
@@ -34,6 +39,7 @@
     #define WIN32_LEAN_AND_MEAN
     #define VC_EXTRALEAN
     #include <winsock2.h>
+    #include <ws2tcpip.h>
     #include <windows.h>
     #undef max // Windows is lame
     #undef errno // Arguably stupid
@@ -43,8 +49,11 @@
     #define EWOULDBLOCK WSAEWOULDBLOCK
     #define EADDRINUSE WSAEADDRINUSE
     #define EINPROGRESS WSAEINPROGRESS
+    #define ECONNABORTED WSAECONNABORTED
+    #define EINTR WSAEINTR
     #define EOK ERROR_SUCCESS
     #define close closesocket
+    #define poll WSAPoll
 #else
     #define EOK 0
     #include <sys/socket.h>
@@ -53,7 +62,23 @@
     #include <errno.h>
     #include <string.h>
     #include <fcntl.h>
+    #include <poll.h>
     #include <unistd.h>
+    #include <time.h>
+#endif
+
+#ifdef MSG_NOSIGNAL
+    #define GS_SENDFLAGS MSG_NOSIGNAL /* report EPIPE instead of raising SIGPIPE */
+#else
+    #define GS_SENDFLAGS 0
+#endif
+
+#ifdef __linux__
+    #define GS_SHM
+    #include <sys/eventfd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
 #endif
 
 
@@ -61,6 +86,38 @@
 
 #define max(x,y) ((x)>(y)?(x):(y))
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define GS_BIG_ENDIAN
+#endif
+
+/* Copies 'count' elements of 'size' bytes each, converting between host byte
+ * order and wire byte order.  Packed arrays are little-endian on the wire, so
+ * on little-endian hosts this is a plain memcpy.  On big-endian hosts, the
+ * loops are kept simple so that the compiler vectorizes the byte swaps. */
+static void gs_swapcpy(char* dst, char const* src, int32_t count, size_t size) {
+#ifdef GS_BIG_ENDIAN
+    if (size == sizeof(uint32_t)) {
+        for (int32_t i = 0; i < count; ++i) {
+            uint32_t val;
+            memcpy(&val, src + i*size, size);
+            val = __builtin_bswap32(val);
+            memcpy(dst + i*size, &val, size);
+        }
+    } else if (size == sizeof(uint64_t)) {
+        for (int32_t i = 0; i < count; ++i) {
+            uint64_t val;
+            memcpy(&val, src + i*size, size);
+            val = __builtin_bswap64(val);
+            memcpy(dst + i*size, &val, size);
+        }
+    } else {
+        assert(!"bad element size");
+    }
+#else
+    memcpy(dst, src, count*size);
+#endif
+}
+
 /* Set common socket flags/connection control options */
 static void gs_setflags(gs_Socket* sd) {
 #ifdef _WIN32
@@ -70,6 +127,10 @@ static void gs_setflags(gs_Socket* sd) {
 	int const flags = fcntl(sd->sd, F_GETFL, 0);
 	assert(!fcntl(sd->sd, F_SETFL, flags | O_NONBLOCK));
 #endif
+#ifdef SO_NOSIGPIPE
+    int const on = 1;
+    setsockopt(sd->sd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
 }
 
 /* Returns an error string for the given system-specific error code */
@@ -86,24 +147,620 @@ char const* gs_strerror(int error) {
 #endif
 }
 
+/* SHARED MEMORY TRANSPORT */
+
+/* Same-host connections use two gs_Ring buffers in a shared memory segment,
+ * one per direction, instead of a socket.  Each side has an eventfd that the
+ * other side signals when it adds data or frees space, so the connection can
+ * still be waited on by gs_poll.  The connecting side creates the segment and
+ * both eventfds, and passes them to the listener over a Unix domain socket.
+ * The Unix socket then stays open, so that each side sees EOF on it if the
+ * other process exits without closing the ring. */
+
+static gs_Socket* gs_alloc();
+static int gs_accept_fd(gs_Socket* sd);
+static void gs_spare_open();
+void gs_close(gs_Socket* sd);
+
+#ifdef GS_SHM
+#define gs_load(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define gs_store(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+
+/* Sets the abstract Unix socket address for the given name */
+static socklen_t gs_shm_addr(struct sockaddr_un* sun, char const* name) {
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    snprintf(sun->sun_path+1, sizeof(sun->sun_path)-1, "gamesync/%s", name);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sun->sun_path+1);
+}
+
+/* Wakes up the peer */
+static void gs_shm_notify(gs_Socket* sd) {
+    uint64_t const one = 1;
+    ssize_t const ret = write(sd->peer, &one, sizeof(one));
+    (void)ret; /* EAGAIN: the counter is already non-zero */
+}
+
+/* Maps the ring segment from 'fd'.  The connecting side sends on ring 0. */
+static int gs_shm_map(gs_Socket* sd, int fd, int connector) {
+    gs_Ring* ring = mmap(0, 2*sizeof(gs_Ring), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        sd->status = errno;
+        sd->state = gs_error;
+        return 0;
+    }
+    sd->tx = connector ? ring : ring+1;
+    sd->rx = connector ? ring+1 : ring;
+    sd->state = gs_idle;
+    return 1;
+}
+#endif
+
+/* Creates a new socket for the shared memory transport.  The socket is used
+ * to listen for connections, or is replaced by the ring on connect. */
+gs_Socket* gs_shm_socket() {
+    gs_Socket* sd = gs_alloc();
+    sd->transport = gs_shm;
+#ifdef GS_SHM
+    sd->sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sd->status = sd->sd < 0 ? errno : 0;
+    assert(!sd->status);
+	gs_setflags(sd);
+#endif
+    return sd;
+}
+
+/* Creates the ring segment and connects to the listener named 'name'.  The
+ * segment is sealed against shrinking, so that the peer can map it without
+ * risking SIGBUS. */
+void gs_shm_connect(gs_Socket* sd, char const* name) {
+#ifdef GS_SHM
+    struct sockaddr_un sun;
+    socklen_t const len = gs_shm_addr(&sun, name);
+    int fds[3] = { -1, -1, -1 }; /* segment, own eventfd, peer eventfd */
+    char cmsgbuf[CMSG_SPACE(sizeof(fds))];
+    char byte = 0;
+    struct iovec iov = { &byte, sizeof(byte) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg = 0;
+
+    fds[0] = memfd_create("gamesync", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0
+        || ftruncate(fds[0], 2*sizeof(gs_Ring)) < 0
+        || fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK) < 0
+        || connect(sd->sd, (struct sockaddr*)&sun, len) < 0) {
+        sd->status = errno;
+        sd->state = gs_error;
+        for (int i = 0; i < 3; ++i) {
+            if (fds[i] >= 0) { close(fds[i]); }
+        }
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsgbuf, 0, sizeof(cmsgbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    int const ret = sendmsg(sd->sd, &msg, 0);
+    sd->status = ret < 0 ? errno : 0;
+
+    sd->link = sd->sd;
+    sd->sd = fds[1];
+    sd->peer = fds[2];
+    if (sd->status) {
+        sd->state = gs_error;
+    } else {
+        gs_shm_map(sd, fds[0], 1);
+    }
+    close(fds[0]);
+#else
+    sd->status = 1;
+    sd->state = gs_error;
+#endif
+}
+
+/* Listens for shared memory connections under the name 'name' */
+void gs_shm_listen(gs_Socket* sd, char const* name, int backlog) {
+#ifdef GS_SHM
+    struct sockaddr_un sun;
+    socklen_t const len = gs_shm_addr(&sun, name);
+    int ret = bind(sd->sd, (struct sockaddr*)&sun, len);
+    sd->status = ret < 0 ? errno : 0;
+
+    switch (sd->status) {
+    case EADDRINUSE: sd->state = gs_error; return;
+    case EOK: break; 
+    default:
+        assert(!"bad return status");
+    }
+
+    ret = listen(sd->sd, backlog ? backlog : SOMAXCONN);
+    sd->status = ret < 0 ? errno : 0;
+    sd->state = gs_listening;
+    assert(!sd->status);
+    gs_spare_open();
+#else
+    sd->status = 1;
+    sd->state = gs_error;
+#endif
+}
+
+#ifdef GS_SHM
+/* Returns true if 'fd' is a segment that can hold both rings, and is sealed
+ * against shrinking.  A peer that sends a short or shrinkable segment could
+ * otherwise make the rings fault with SIGBUS. */
+static int gs_shm_valid(int fd) {
+    struct stat st;
+    int const seals = fcntl(fd, F_GET_SEALS);
+    return fstat(fd, &st) == 0 && st.st_size >= (off_t)(2*sizeof(gs_Ring))
+        && seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+/* Receives the ring segment and eventfds from a connection accepted by the
+ * listener, and maps the segment.  Returns 1 if the socket is ready, 0 if the
+ * fds haven't arrived yet, or -1 if the handshake failed.  On failure, any
+ * fds the peer sent are closed. */
+static int gs_shm_handshake(gs_Socket* sd) {
+    int fds[3] = { -1, -1, -1 };
+    char cmsgbuf[CMSG_SPACE(sizeof(fds))];
+    char byte = 0;
+    struct iovec iov = { &byte, sizeof(byte) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsgbuf, 0, sizeof(cmsgbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    int const len = recvmsg(sd->sd, &msg, MSG_CMSG_CLOEXEC|MSG_DONTWAIT);
+    sd->status = len < 0 ? errno : 0;
+    if (len < 0 && sd->status == EWOULDBLOCK) {
+        return 0;
+    } else if (len < 0) {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (len == 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET 
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))
+        || (msg.msg_flags & MSG_CTRUNC)) {
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            /* Close whatever fds were sent, so that they don't leak */
+            int const n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < n; ++i) {
+                int fd = -1;
+                memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(fd));
+                close(fd);
+            }
+        }
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (!gs_shm_valid(fds[0])) {
+        for (int i = 0; i < 3; ++i) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    sd->link = sd->sd;
+    sd->sd = fds[2];
+    sd->peer = fds[1];
+    gs_shm_map(sd, fds[0], 0);
+    close(fds[0]);
+    return sd->state == gs_idle ? 1 : -1;
+}
+#endif
+
+/* Accepts a shared memory connection, and maps the ring segment sent by the
+ * connecting side.  New connections are non-blocking, and wait on the
+ * listener's pending list until their fds arrive, so that a peer that
+ * connects and sends nothing can't block the listener.  Returns null if no
+ * handshake is complete. */
+static gs_Socket* gs_shm_accept(gs_Socket* sd) {
+#ifdef GS_SHM
+    gs_Socket** link = &sd->pending;
+    for (;;) {
+        int const conn = gs_accept_fd(sd);
+        if (conn < 0) {
+            break;
+        }
+        gs_Socket* ret = gs_alloc(); 
+        ret->transport = gs_shm;
+        ret->sd = conn;
+        ret->state = gs_connecting;
+        ret->next = sd->pending;
+        sd->pending = ret;
+    }
+    while (*link) {
+        gs_Socket* ret = *link;
+        int const status = gs_shm_handshake(ret);
+        if (!status) {
+            link = &ret->next;
+            continue;
+        }
+        *link = ret->next;
+        ret->next = 0;
+        if (status > 0) {
+            return ret;
+        }
+        gs_close(ret);
+    }
+    return 0;
+#else
+    sd->status = 1;
+    return 0;
+#endif
+}
+
+/* Unmaps the ring segment and closes the peer eventfd */
+static void gs_shm_close(gs_Socket* sd) {
+#ifdef GS_SHM
+    if (sd->rx) {
+        gs_store(&sd->tx->closed, 1);
+        gs_shm_notify(sd);
+        munmap(sd->tx < sd->rx ? sd->tx : sd->rx, 2*sizeof(gs_Ring));
+    }
+    if (sd->peer >= 0) {
+        close(sd->peer);
+    }
+    if (sd->link >= 0) {
+        close(sd->link);
+    }
+#endif
+    sd->tx = 0;
+    sd->rx = 0;
+    sd->peer = -1;
+    sd->link = -1;
+}
+
+/* Copies up to 'len' bytes into the tx ring.  Behaves like send() on a
+ * non-blocking socket. */
+static int gs_shm_send(gs_Socket* sd, char const* buf, size_t len) {
+#ifdef GS_SHM
+    gs_Ring* const ring = sd->tx;
+    uint32_t const head = ring->head;
+    uint32_t const tail = gs_load(&ring->tail);
+    uint32_t const n = (uint32_t)(len < gs_ringsize-(head-tail) ? len : gs_ringsize-(head-tail));
+    uint32_t const pos = head % gs_ringsize;
+    uint32_t const first = n < gs_ringsize-pos ? n : gs_ringsize-pos;
+    if (!n) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    memcpy(ring->data+pos, buf, first);
+    memcpy(ring->data, buf+first, n-first);
+    gs_store(&ring->head, head+n);
+    if (gs_load(&ring->tail) == head) {
+        gs_shm_notify(sd); /* the ring was empty, so the peer may be asleep */
+    }
+    return n;
+#else
+    return -1;
+#endif
+}
+
+/* Copies up to 'len' bytes out of the rx ring.  Behaves like recv() on a
+ * non-blocking socket. */
+static int gs_shm_recv(gs_Socket* sd, char* buf, size_t len) {
+#ifdef GS_SHM
+    gs_Ring* const ring = sd->rx;
+    uint32_t const tail = ring->tail;
+    uint32_t head = gs_load(&ring->head);
+    if (head == tail && gs_load(&ring->closed)) {
+        /* The peer may have written its last bytes between the two loads;
+         * they are published before 'closed', so load 'head' again */
+        head = gs_load(&ring->head);
+        if (head == tail) {
+            sd->state = gs_closed;
+            return 0;
+        }
+    }
+    uint32_t const n = (uint32_t)(len < head-tail ? len : head-tail);
+    uint32_t const pos = tail % gs_ringsize;
+    uint32_t const first = n < gs_ringsize-pos ? n : gs_ringsize-pos;
+    if (!n) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    memcpy(buf, ring->data+pos, first);
+    memcpy(buf+first, ring->data, n-first);
+    gs_store(&ring->tail, tail+n);
+    if (gs_ringsize-(gs_load(&ring->head)-tail) < gs_bufsize) {
+        gs_shm_notify(sd); /* the ring was nearly full; the peer may be asleep */
+    }
+    return n;
+#else
+    return -1;
+#endif
+}
+
+/* Sets the socket flags from the state of the rings.  Returns true if the
+ * socket is ready without waiting.  Once the peer has closed and the ring is
+ * drained, the socket is in the closed state, and is never ready again. */
+static int gs_shm_poll(gs_Socket* sd) {
+#ifdef GS_SHM
+    if (sd->state == gs_closed || sd->state == gs_error) {
+        return 0;
+    }
+    if (gs_load(&sd->rx->head) != sd->rx->tail || gs_load(&sd->rx->closed)) {
+        sd->flags |= gs_read;
+    }
+    if (sd->write_ptr != sd->write_buf 
+        && sd->tx->head - gs_load(&sd->tx->tail) < gs_ringsize) {
+        sd->flags |= gs_write;
+    }
+#endif
+    return sd->flags != 0;
+}
+
+/* Resets the eventfd if it was signaled, then updates the socket flags.  If
+ * the link to the peer is readable, the peer has exited: the rx ring is
+ * marked closed, so that the socket closes once the ring is drained. */
+static void gs_shm_wake(gs_Socket* sd, int signaled, int unlinked) {
+#ifdef GS_SHM
+    uint64_t count = 0;
+    char byte = 0;
+    if (signaled) {
+        ssize_t const ret = read(sd->sd, &count, sizeof(count));
+        (void)ret;
+    }
+    if (unlinked) {
+        ssize_t const ret = recv(sd->link, &byte, sizeof(byte), MSG_DONTWAIT);
+        if (ret == 0 || (ret < 0 && errno != EWOULDBLOCK)) {
+            gs_store(&sd->rx->closed, 1);
+        }
+    }
+#endif
+    sd->flags = 0;
+    gs_shm_poll(sd);
+}
+
+/* TIMERS */
+
+/* Timers are kept on a hierarchical timer wheel with 1ms ticks.  Level 0 has
+ * one slot per tick for the next 64 ticks; each higher level has slots that
+ * are 64 times wider.  When the wheel reaches the start of a slot on a higher
+ * level, the timers in that slot are moved down a level ("cascaded").  Timers
+ * that are due are moved to the expired list, and collected by the caller
+ * with gs_timer_expire after gs_poll. */
+
+#define gs_tickus 1000 /* microseconds per tick */
+#define gs_wheelbits 6
+#define gs_wheelsize (1 << gs_wheelbits)
+#define gs_wheelmask (gs_wheelsize - 1)
+#define gs_wheellevels 4
+
+static gs_Timer* gs_wheel[gs_wheellevels][gs_wheelsize];
+static gs_Time gs_wheel_tick = 0; /* tick the wheel has advanced to */
+static int gs_ntimers = 0; /* number of timers on the wheel */
+static gs_Timer* gs_expired = 0; /* timers that are due */
+
+/* Returns the current monotonic time */
+gs_Time gs_now() {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (gs_Time)(count.QuadPart / freq.QuadPart * 1000000
+        + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gs_Time)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Links the timer into the list at 'head' */
+static void gs_timer_link(gs_Timer* timer, gs_Timer** head) {
+    timer->next = *head;
+    timer->prev = head;
+    if (timer->next) {
+        timer->next->prev = &timer->next;
+    }
+    *head = timer;
+}
+
+/* Unlinks the timer from the list it's on, if any */
+static void gs_timer_unlink(gs_Timer* timer) {
+    if (timer->prev) {
+        *timer->prev = timer->next;
+        if (timer->next) {
+            timer->next->prev = timer->prev;
+        }
+    }
+    if (timer->wheel) {
+        gs_ntimers--;
+    }
+    timer->next = 0;
+    timer->prev = 0;
+    timer->wheel = 0;
+}
+
+/* Puts the timer on the wheel, or on the expired list if it's due */
+static void gs_timer_insert(gs_Timer* timer) {
+    gs_Time tick = (timer->deadline + gs_tickus - 1) / gs_tickus;
+    gs_Time const span = (gs_Time)1 << (gs_wheelbits * gs_wheellevels);
+    int level = 0;
+    if (tick <= gs_wheel_tick) {
+        gs_timer_link(timer, &gs_expired);
+        return;
+    }
+    if (tick - gs_wheel_tick >= span) {
+        tick = gs_wheel_tick + span - 1; /* re-inserted when cascaded */
+    }
+    while ((tick - gs_wheel_tick) >> (gs_wheelbits * (level+1))) {
+        level++;
+    }
+    gs_timer_link(timer, &gs_wheel[level][(tick >> (gs_wheelbits*level)) & gs_wheelmask]);
+    timer->wheel = 1;
+    gs_ntimers++;
+}
+
+/* Creates a timer that expires after 'delay'.  If 'period' is non-zero, the
+ * timer then expires every 'period' until cancelled. */
+gs_Timer* gs_timer(gs_Time delay, gs_Time period) {
+    gs_Timer* timer = calloc(sizeof(gs_Timer), 1);
+    gs_Time const now = gs_now();
+    if (!gs_ntimers && !gs_expired) {
+        gs_wheel_tick = now / gs_tickus; /* the wheel was idle */
+    }
+    timer->deadline = now + delay;
+    timer->period = period;
+    gs_timer_insert(timer);
+    return timer;
+}
+
+/* Cancels and frees the timer */
+void gs_timer_cancel(gs_Timer* timer) {
+    gs_timer_unlink(timer);
+    free(timer);
+}
+
+/* Returns the next expired timer, or null if no timers are due.  Periodic
+ * timers are re-armed for their next deadline; if deadlines were missed, they
+ * are skipped rather than fired in a burst.  One-shot timers are no longer
+ * scheduled, and should be freed with gs_timer_cancel. */
+gs_Timer* gs_timer_expire() {
+    gs_Timer* timer = gs_expired;
+    if (!timer) {
+        return 0;
+    }
+    gs_timer_unlink(timer);
+    if (timer->period) {
+        gs_Time const now = gs_wheel_tick * gs_tickus;
+        timer->deadline += timer->period;
+        if (timer->deadline < now) {
+            timer->deadline += (now - timer->deadline) / timer->period * timer->period;
+            timer->deadline += timer->period;
+        }
+        /* Re-arm on the wheel, so that this call doesn't return it again */
+        gs_Time const tick = (timer->deadline + gs_tickus - 1) / gs_tickus;
+        if (tick <= gs_wheel_tick) {
+            timer->deadline = (gs_wheel_tick + 1) * gs_tickus;
+        }
+        gs_timer_insert(timer);
+    }
+    return timer;
+}
+
+/* Returns the time from 'now' until the wheel next needs to advance: either
+ * a timer is due, or a slot needs to be cascaded.  Returns gs_never if there
+ * are no timers. */
+gs_Time gs_timer_next(gs_Time now) {
+    if (gs_expired) {
+        return 0;
+    }
+    if (!gs_ntimers) {
+        return gs_never;
+    }
+    for (int level = 0; level < gs_wheellevels; ++level) {
+        gs_Time const base = gs_wheel_tick >> (gs_wheelbits*level);
+        for (gs_Time k = 1; k <= gs_wheelsize; ++k) {
+            if (gs_wheel[level][(base + k) & gs_wheelmask]) {
+                gs_Time const when = ((base + k) << (gs_wheelbits*level)) * gs_tickus;
+                return when > now ? when - now : 0;
+            }
+        }
+    }
+    return gs_never;
+}
+
+/* Advances the wheel to 'now', moving timers that are due to the expired
+ * list */
+void gs_timer_advance(gs_Time now) {
+    gs_Time const tick = now / gs_tickus;
+    while (gs_wheel_tick < tick && gs_ntimers) {
+        gs_wheel_tick++;
+        for (int level = gs_wheellevels-1; level > 0; --level) {
+            gs_Time const mask = ((gs_Time)1 << (gs_wheelbits*level)) - 1;
+            if (gs_wheel_tick & mask) {
+                continue; /* not at the start of a slot on this level */
+            }
+            gs_Timer** slot = &gs_wheel[level][(gs_wheel_tick >> (gs_wheelbits*level)) & gs_wheelmask];
+            while (*slot) {
+                gs_Timer* timer = *slot;
+                gs_timer_unlink(timer);
+                gs_timer_insert(timer);
+            }
+        }
+        gs_Timer** slot = &gs_wheel[0][gs_wheel_tick & gs_wheelmask];
+        while (*slot) {
+            gs_Timer* timer = *slot;
+            gs_timer_unlink(timer);
+            gs_timer_link(timer, &gs_expired);
+        }
+    }
+    if (gs_wheel_tick < tick) {
+        gs_wheel_tick = tick; /* no timers left; skip ahead */
+    }
+}
+
 /* CONNECTION MANAGEMENT */
 
+static gs_Socket* gs_free = 0; /* pool of closed sockets */
+
+/* Adds 'n' sockets to the pool, allocated in one block.  Sockets taken from
+ * the pool don't need to be allocated or zeroed, which keeps accept() cheap
+ * when many clients connect at once. */
+void gs_reserve(int n) {
+    gs_Socket* block = malloc(sizeof(gs_Socket) * n);
+    assert(block || !n);
+    for (int i = 0; i < n; ++i) {
+        block[i].next = gs_free;
+        gs_free = &block[i];
+    }
+}
+
+/* Allocates a socket with empty buffers, from the pool if possible */
+static gs_Socket* gs_alloc() {
+    gs_Socket* sd = gs_free;
+    if (sd) {
+        gs_free = sd->next;
+    } else {
+        sd = malloc(sizeof(gs_Socket));
+        assert(sd);
+    }
+    sd->sd = -1;
+    sd->peer = -1;
+    sd->link = -1;
+    sd->status = 0;
+    sd->state = gs_nil;
+    sd->flags = 0;
+    sd->transport = gs_tcp;
+    sd->tx = 0;
+    sd->rx = 0;
+    sd->next = 0;
+    sd->pending = 0;
+    sd->write_checkpoint = 0;
+    sd->read_checkpoint = 0;
+    sd->write_ptr = sd->write_buf;
+    sd->write_start = sd->write_buf;
+    sd->read_ptr = sd->read_buf;
+    sd->read_end = sd->read_buf;
+    return sd;
+}
+
 /* Creates a new socket */
 gs_Socket* gs_socket() {
-    gs_Socket* sd = calloc(sizeof(gs_Socket), 1);
+    gs_Socket* sd = gs_alloc();
 #ifdef _WIN32
     WORD version = MAKEWORD(2, 2);
     WSADATA data;
     WSAStartup(version, &data);
 #endif
     sd->sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    sd->status = sd < 0 ? errno : 0;
-    sd->state = gs_nil;
-    sd->flags = 0;
-    sd->write_ptr = sd->write_buf;
-    sd->write_start = sd->write_buf;
-    sd->read_ptr = sd->read_buf;
-    sd->read_end = sd->read_buf;
+    sd->status = sd->sd < 0 ? errno : 0;
     assert(!sd->status);
 	gs_setflags(sd);
     return sd;
@@ -111,11 +768,20 @@ gs_Socket* gs_socket() {
 
 /* Closes the socket connection */
 void gs_close(gs_Socket* sd) {
-    int const ret = close(sd->sd);
+    while (sd->pending) {
+        gs_Socket* const pending = sd->pending;
+        sd->pending = pending->next;
+        gs_close(pending);
+    }
+    if (sd->transport == gs_shm) {
+        gs_shm_close(sd);
+    }
+    int const ret = sd->sd < 0 ? 0 : close(sd->sd);
     sd->status = ret < 0 ? errno : 0;
     sd->state = gs_closed;
     assert(!sd->status);
-    free(sd);
+    sd->next = gs_free;
+    gs_free = sd;
 }
 
 /* Connects to the given addr/port, and resumes the given coroutine when the
@@ -143,9 +809,9 @@ void gs_connect(gs_Socket* sd, char const* addr, uint16_t port) {
     }
 }
 
-/* Sets the listen port for the socket */
-void gs_listen(gs_Socket* sd, uint16_t port) {
-    int const backlog = 10;
+/* Sets the listen port for the socket.  'backlog' is the number of pending
+ * connections the OS will queue; if zero, the OS maximum is used. */
+void gs_listen(gs_Socket* sd, uint16_t port, int backlog) {
     int ret = 0;
 
     struct sockaddr_in sin;
@@ -154,6 +820,11 @@ void gs_listen(gs_Socket* sd, uint16_t port) {
     sin.sin_port = htons(port);
     sin.sin_family = AF_INET;
 
+#ifndef _WIN32
+    /* Let a restarted server listen while old connections are in TIME_WAIT */
+    int const on = 1;
+    setsockopt(sd->sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#endif
     ret = bind(sd->sd, (struct sockaddr*)&sin, sizeof(sin));
     sd->status = ret < 0 ? errno : 0;
 
@@ -164,67 +835,217 @@ void gs_listen(gs_Socket* sd, uint16_t port) {
         assert(!"bad return status");
     }
 
-    ret = listen(sd->sd, backlog);
+    ret = listen(sd->sd, backlog ? backlog : SOMAXCONN);
     sd->status = ret < 0 ? errno : 0;
     sd->state = gs_listening;
     assert(!sd->status);
+    gs_spare_open();
+}
+
+#ifndef _WIN32
+static int gs_spare = -1; /* fd kept open to shed connections at the fd limit */
+#endif
+
+/* Opens the spare fd, if it isn't open already */
+static void gs_spare_open() {
+#ifndef _WIN32
+    if (gs_spare < 0) {
+        gs_spare = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    }
+#endif
+}
+
+/* Accepts and immediately closes every pending connection, using the spare
+ * fd.  Called when the process is out of fds: the connections can't be
+ * accepted, but leaving them queued would keep the listener readable, and
+ * gs_poll would return at once forever.  The clients see a close, and
+ * reconnect later. */
+static void gs_shed(gs_Socket* sd) {
+#ifndef _WIN32
+    while (gs_spare >= 0) {
+        close(gs_spare);
+        int const conn = accept(sd->sd, 0, 0);
+        if (conn >= 0) {
+            close(conn);
+        }
+        gs_spare = -1;
+        gs_spare_open();
+        if (conn < 0) {
+            break;
+        }
+    }
+#endif
 }
 
-/* Accepts incoming connections */
+/* Accepts one connection on the listener and returns its fd, or -1 with the
+ * error in the listener's status.  Connections that were aborted before they
+ * were accepted are skipped. */
+static int gs_accept_fd(gs_Socket* sd) {
+    for (;;) {
+#ifdef __linux__
+        int const conn = accept4(sd->sd, 0, 0, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+        int const conn = accept(sd->sd, 0, 0);
+#endif
+        sd->status = conn < 0 ? errno : 0;
+        if (conn >= 0) {
+            return conn;
+        }
+        switch (sd->status) {
+        case EINTR: continue;
+        case ECONNABORTED: continue;
+#ifndef _WIN32
+        case EMFILE: gs_shed(sd); sd->status = EMFILE; return -1;
+        case ENFILE: gs_shed(sd); sd->status = ENFILE; return -1;
+#endif
+        default: return -1;
+        }
+    }
+}
+
+/* Accepts one pending connection.  Returns null if there are no more pending
+ * connections, or if accept failed; the listener's status has the error.  Call
+ * repeatedly to drain the backlog.  Interrupted and aborted accepts are
+ * retried.  If the process is out of fds, the pending connections are
+ * dropped, rather than left to make the listener readable forever. */
 gs_Socket* gs_accept(gs_Socket* sd) {
-    gs_Socket* ret = calloc(sizeof(gs_Socket), 1); 
-    ret->sd = accept(sd->sd, 0, 0);
-    ret->status = sd->sd < 0 ? errno : 0;
+    if (sd->transport == gs_shm) {
+        return gs_shm_accept(sd);
+    }
+    int const conn = gs_accept_fd(sd);
+    if (conn < 0) {
+        return 0;
+    }
+    gs_Socket* ret = gs_alloc(); 
+    ret->sd = conn;
     ret->state = gs_idle;
-    ret->write_ptr = ret->write_buf;
-    ret->write_start = ret->write_buf;
-    ret->read_ptr = ret->read_buf;
-    ret->read_end = ret->read_buf;
-	gs_setflags(sd);
+#ifndef __linux__
+	gs_setflags(ret);
+#endif
     return ret;
 }
 
+/* Finishes a non-blocking connect.  A refused connect also makes the socket
+ * writable, so the result is read from SO_ERROR. */
+static void gs_connected(gs_Socket* sd) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sd->sd, SOL_SOCKET, SO_ERROR, (char*)&error, &len) < 0) {
+        error = errno;
+    }
+    sd->status = error;
+    if (error) {
+        sd->state = gs_error;
+    } else {
+        sd->state = gs_idle;
+        sd->flags |= gs_write;
+    }
+}
+
+static struct pollfd* gs_pollfds = 0; /* reused by each gs_poll call */
+static int gs_pollcap = 0;
+
+/* Adds 'fd' to the pollfd array and returns its index.  Unlike select(),
+ * poll() has no limit on the fd number, so servers can hold thousands of
+ * connections. */
+static int gs_pollfd(int* nfds, int fd, short events) {
+    if (*nfds == gs_pollcap) {
+        gs_pollcap = gs_pollcap ? gs_pollcap * 2 : 64;
+        gs_pollfds = realloc(gs_pollfds, sizeof(struct pollfd) * gs_pollcap);
+        assert(gs_pollfds);
+    }
+    gs_pollfds[*nfds].fd = fd;
+    gs_pollfds[*nfds].events = events;
+    gs_pollfds[*nfds].revents = 0;
+    return (*nfds)++;
+}
+
 /* Poll for readable/writable sockets in the socket array. If 'wait' is true,
- * then wait until at least one socket is readable/writable. 
+ * then wait until at least one socket is readable/writable, or until the next
+ * timer is due.  Timers that are due afterwards can be collected with
+ * gs_timer_expire.
  */
 void gs_poll(gs_Socket** sds, int nsds, int wait) {
-    struct timeval tv = { 0, 0 };
-    fd_set rdfds, wrfds, exfds;
+    gs_Time timeout = 0;
     int nfds = 0;
-    FD_ZERO(&rdfds);
-    FD_ZERO(&wrfds);
-    FD_ZERO(&exfds);
+    int ready = 0;
 
-    /* Set up FD_SETs. */
+    /* Set up the pollfd array; each socket records the index of its entry */
     for (int i = 0; i < nsds; ++i) {
         gs_Socket* const sd = sds[i];
         sd->flags = 0;
-        nfds = max(nfds, sd->sd);
-        if (sd->state != gs_error) {
-            FD_SET(sd->sd, &rdfds);
-            FD_SET(sd->sd, &exfds);
+        sd->slot = -1;
+        if (sd->sd < 0) {
+            continue;
+        }
+        if (sd->rx) {
+            /* Shared memory: wait on the eventfd, unless a ring is ready.  The
+             * link, if any, is polled in the entry after the eventfd. */
+            ready |= gs_shm_poll(sd);
+            if (sd->state != gs_closed && sd->state != gs_error) {
+                sd->slot = gs_pollfd(&nfds, sd->sd, POLLIN);
+                if (sd->link >= 0) {
+                    gs_pollfd(&nfds, sd->link, POLLIN);
+                }
+            }
+            continue;
         }
-        if (sd->state == gs_error) {
+        for (gs_Socket* hs = sd->pending; hs; hs = hs->next) {
+            /* Shared memory handshakes: wait for the fds to arrive */
+            hs->slot = gs_pollfd(&nfds, hs->sd, POLLIN);
+        }
+        if (sd->state == gs_error || sd->state == gs_closed) {
             // Skip 
         } else if (sd->write_ptr != sd->write_buf) {
-            FD_SET(sd->sd, &wrfds);
+            sd->slot = gs_pollfd(&nfds, sd->sd, POLLIN|POLLPRI|POLLOUT);
         } else if (sd->state == gs_connecting) {
-            FD_SET(sd->sd, &wrfds);
+            sd->slot = gs_pollfd(&nfds, sd->sd, POLLIN|POLLPRI|POLLOUT);
+        } else {
+            sd->slot = gs_pollfd(&nfds, sd->sd, POLLIN|POLLPRI);
         }
     }
 
-    select(nfds+1, &rdfds, &wrfds, &exfds, wait ? 0 : &tv);
+    if (wait && !ready) {
+        timeout = gs_timer_next(gs_now()); /* gs_never waits indefinitely */
+    }
+#if defined(__linux__)
+    struct timespec ts = { (time_t)(timeout / 1000000), (long)(timeout % 1000000) * 1000 };
+    ppoll(gs_pollfds, nfds, timeout == gs_never ? 0 : &ts, 0);
+#else
+    /* poll() takes milliseconds; round up so that timers are due on return */
+    int const ms = timeout == gs_never ? -1 : (int)((timeout + 999) / 1000);
+#ifdef _WIN32
+    if (!nfds) {
+        Sleep(ms < 0 ? INFINITE : (DWORD)ms); /* WSAPoll needs at least one fd */
+    } else
+#endif
+    poll(gs_pollfds, nfds, ms);
+#endif
+    gs_timer_advance(gs_now());
 
     for (int i = 0; i < nsds; ++i) {
         gs_Socket* const sd = sds[i];
-        if (FD_ISSET(sd->sd, &wrfds)) {
+        for (gs_Socket* hs = sd->pending; hs; hs = hs->next) {
+            if (gs_pollfds[hs->slot].revents) {
+                sd->flags |= gs_read;
+            }
+        }
+        if (sd->slot < 0) {
+            continue;
+        }
+        short const revents = gs_pollfds[sd->slot].revents;
+        if (sd->rx) {
+            int const unlinked = sd->link >= 0 && gs_pollfds[sd->slot+1].revents;
+            gs_shm_wake(sd, revents != 0, unlinked);
+        } else if (sd->state == gs_connecting) {
+            if (revents & (POLLOUT|POLLERR|POLLHUP)) {
+                gs_connected(sd);
+            }
+        } else if (revents & POLLOUT) {
             sd->flags |= gs_write;
-			if (sd->state == gs_connecting) {
-				sd->state = gs_idle;
-			}
-        } else if (FD_ISSET(sd->sd, &exfds)) {
+        } else if (revents & POLLPRI) {
             sd->status = 1;
-        } else if (FD_ISSET(sd->sd, &rdfds)) {
+        } else if (revents & (POLLIN|POLLERR|POLLHUP)) {
             sd->flags |= gs_read; 
         }
     }
@@ -302,23 +1123,39 @@ void gs_flush(gs_Socket* sd) {
     if (!len) {
         return;
     } 
-    int const ret = send(sd->sd, sd->write_start, len, 0);
-    if (ret < 0) {
+    int const ret = sd->rx ?
+        gs_shm_send(sd, sd->write_start, len) :
+        send(sd->sd, sd->write_start, len, GS_SENDFLAGS);
+    if (ret < 0 && errno == EWOULDBLOCK) {
+        return; /* socket buffer is full; try again when writable */
+    } else if (ret < 0) {
         sd->status = errno;
         sd->state = gs_error;
-        if (!sd->write_checkpoint) {
+        if (sd->write_checkpoint) {
             sd->write_ptr = sd->write_checkpoint;
             sd->write_checkpoint = 0;
         }
     } else {
-        sd->write_start += len;
+        sd->write_start += ret;
     }
     if (sd->write_start == sd->write_ptr) {
         sd->write_start = sd->write_buf;
         sd->write_ptr = sd->write_buf;
+    } else if (!sd->write_checkpoint) {
+        /* Partial send: move the unsent bytes to the front of the buffer so
+         * that the space that was sent can be reused. */
+        ptrdiff_t const left = sd->write_ptr - sd->write_start;
+        memmove(sd->write_buf, sd->write_start, left);
+        sd->write_start = sd->write_buf;
+        sd->write_ptr = sd->write_buf + left;
     }
 }
 
+/* Returns the number of bytes free in the write buffer */
+int32_t gs_send_space(gs_Socket* sd) {
+    return (int32_t)(sd->write_buf + sizeof(sd->write_buf) - sd->write_ptr);
+}
+
 
 int gs_send_str(gs_Socket* sd, char const* str) {
     int32_t const len = strlen(str);
@@ -336,6 +1173,23 @@ int gs_send_str(gs_Socket* sd, char const* str) {
     return 1;
 }
 
+/* Sends 'len' bytes of binary data, prefixed by the length.  The data must
+ * fit in the write buffer; larger values are split up by the caller. */
+int gs_send_buf(gs_Socket* sd, char const* buf, int32_t len) {
+    int32_t const netlen = htonl(len);
+    if (!gs_send_ok(sd, sizeof(len))) {
+        return 0;
+    }
+    memcpy(sd->write_ptr, &netlen, sizeof(len));
+    sd->write_ptr += sizeof(len);
+    if (!gs_send_ok(sd, len)) {
+        return 0;
+    }
+    memcpy(sd->write_ptr, buf, len);
+    sd->write_ptr += len;
+    return 1;
+}
+
 int gs_send_typeid(gs_Socket* sd, gs_TypeId id) {
     if (!gs_send_ok(sd, sizeof(id))) {
         return 0;
@@ -364,18 +1218,90 @@ int gs_send_num(gs_Socket* sd, gs_Number num) {
     return 1;
 }
 
-void gs_fetch(gs_Socket* sd) {
+int gs_send_bool(gs_Socket* sd, int val) {
+    uint8_t const byte = val ? 1 : 0;
+    if (!gs_send_ok(sd, sizeof(byte))) {
+        return 0;
+    }
+    memcpy(sd->write_ptr, &byte, sizeof(byte));
+    sd->write_ptr += sizeof(byte);
+    return 1;
+}
+
+/* Size of an array block header: element type, array length, first element
+ * and element count */
+#define gs_arrayhdr (sizeof(gs_TypeId) + 3*sizeof(uint32_t))
+
+/* Writes the block for elements [first, first+count) of the array to 'buf' */
+static void gs_array_write(char* buf, gs_Array const* arr, int32_t first, int32_t count) {
+    size_t const size = gs_array_elemsize(arr->type);
+    gs_TypeId const type = (gs_TypeId)arr->type;
+    uint32_t header[3] = { htonl(arr->len), htonl(first), htonl(count) };
+    assert(first >= 0 && count >= 0 && first + count <= arr->len);
+    memcpy(buf, &type, sizeof(type));
+    memcpy(buf + sizeof(type), header, sizeof(header));
+    gs_swapcpy(buf + gs_arrayhdr, arr->data + first*size, count, size);
+}
+
+/* Reads a block header from 'buf'.  Returns false if the header is invalid:
+ * an unknown element type, or a range that isn't inside the array. */
+static int gs_array_read(char const* buf, gs_ArrayPatch* patch) {
+    gs_TypeId type = 0;
+    uint32_t header[3];
+    memcpy(&type, buf, sizeof(type));
+    memcpy(header, buf + sizeof(type), sizeof(header));
+    patch->type = (gs_ArrayType)type;
+    patch->len = (int32_t)ntohl(header[0]);
+    patch->first = (int32_t)ntohl(header[1]);
+    patch->count = (int32_t)ntohl(header[2]);
+    return gs_array_elemsize(patch->type) 
+        && patch->len >= 0 && patch->first >= 0 && patch->count >= 0
+        && (int64_t)patch->first + patch->count <= patch->len;
+}
+
+/* Sends elements [first, first+count) of the array as one block.  The block
+ * carries the element type and array length, so that the receiver can size
+ * its copy of the array. */
+int gs_send_array(gs_Socket* sd, gs_Array const* arr, int32_t first, int32_t count) {
+    size_t const size = gs_array_elemsize(arr->type);
+    if (!gs_send_ok(sd, gs_arrayhdr + count*size)) {
+        return 0;
+    }
+    gs_array_write(sd->write_ptr, arr, first, count);
+    sd->write_ptr += gs_arrayhdr + count*size;
+    return 1;
+}
+
+/* Receive from the remote side.  Returns the number of bytes received. */
+int gs_fetch(gs_Socket* sd) {
+    if (!sd->read_checkpoint && sd->read_ptr != sd->read_buf) {
+        /* Move the partially-received message to the front of the buffer, so
+         * that the rest of the message has room to arrive. */
+        ptrdiff_t const left = sd->read_end - sd->read_ptr;
+        memmove(sd->read_buf, sd->read_ptr, left);
+        sd->read_ptr = sd->read_buf;
+        sd->read_end = sd->read_buf + left;
+    }
     ptrdiff_t len = sd->read_buf + sizeof(sd->read_buf) - sd->read_end;
-    int const ret = recv(sd->sd, sd->read_end, len, 0);
-    if (ret < 0) {
+    int const ret = sd->rx ?
+        gs_shm_recv(sd, sd->read_end, len) :
+        recv(sd->sd, sd->read_end, len, 0);
+    if (ret < 0 && errno == EWOULDBLOCK) {
+        return 0; /* nothing to read yet */
+    } else if (ret < 0) {
         sd->status = errno;
         sd->state = gs_error;
-        if (!sd->read_checkpoint) {
+        if (sd->read_checkpoint) {
             sd->read_ptr = sd->read_checkpoint;
             sd->read_checkpoint = 0;
         }
+        return 0;
+    } else if (ret == 0 && !sd->rx) {
+        sd->state = gs_closed; /* the peer closed the connection */
+        return 0;
     } else {
         sd->read_end += ret;
+        return ret;
     }
 }
 
@@ -396,6 +1322,26 @@ char const* gs_recv_str(gs_Socket* sd) {
     return str;
 }
 
+/* Receives binary data sent with gs_send_buf.  The returned pointer is into the
+ * read buffer, and is only valid until the next call to gs_fetch. */
+char const* gs_recv_buf(gs_Socket* sd, int32_t* len) {
+    char const* buf = 0;
+    *len = 0;
+    if (!gs_recv_ok(sd, sizeof(*len))) {
+        return 0;
+    }
+    memcpy(len, sd->read_ptr, sizeof(*len));
+    sd->read_ptr += sizeof(*len);
+    *len = ntohl(*len);
+    if (!gs_recv_ok(sd, *len)) {
+        *len = 0;
+        return 0;
+    }
+    buf = sd->read_ptr;
+    sd->read_ptr += *len;
+    return buf;
+}
+
 gs_TypeId gs_recv_typeid(gs_Socket* sd) {
     gs_TypeId id = 0;
     if (!gs_recv_ok(sd, sizeof(id))) {
@@ -416,6 +1362,31 @@ gs_Id gs_recv_id(gs_Socket* sd) {
     return ntohl(id);
 }
 
+/* Receives a block sent with gs_send_array.  The patch data points into the
+ * read buffer, and is only valid until the next call to gs_fetch.  Returns -1
+ * if the block is invalid, since it can't be skipped. */
+int gs_recv_array(gs_Socket* sd, gs_ArrayPatch* patch) {
+    size_t size = 0;
+    memset(patch, 0, sizeof(*patch));
+    if (!gs_recv_ok(sd, gs_arrayhdr)) {
+        return 0;
+    }
+    if (!gs_array_read(sd->read_ptr, patch) 
+        || (size_t)patch->count > sizeof(sd->read_buf) / gs_array_elemsize(patch->type)) {
+        sd->read_ptr = sd->read_checkpoint;
+        sd->read_checkpoint = 0;
+        return -1;
+    }
+    sd->read_ptr += gs_arrayhdr;
+    size = gs_array_elemsize(patch->type);
+    if (!gs_recv_ok(sd, patch->count*size)) {
+        return 0;
+    }
+    patch->data = sd->read_ptr;
+    sd->read_ptr += patch->count*size;
+    return 1;
+}
+
 gs_Number gs_recv_num(gs_Socket* sd) {
     gs_Number num = 0;
     if (!gs_recv_ok(sd, sizeof(num))) {
@@ -426,6 +1397,94 @@ gs_Number gs_recv_num(gs_Socket* sd) {
     return num;
 }
 
+int gs_recv_bool(gs_Socket* sd) {
+    uint8_t byte = 0;
+    if (!gs_recv_ok(sd, sizeof(byte))) {
+        return 0;
+    }
+    memcpy(&byte, sd->read_ptr, sizeof(byte));
+    sd->read_ptr += sizeof(byte);
+    return byte != 0;
+}
+
+
+/* PACKED ARRAYS */
+
+/* Returns the size of one element of an array of the given type */
+size_t gs_array_elemsize(gs_ArrayType type) {
+    switch (type) {
+    case gs_f32: return sizeof(float);
+    case gs_f64: return sizeof(double);
+    case gs_i32: return sizeof(int32_t);
+    default: return 0;
+    }
+}
+
+/* Returns the number of bytes needed to hold the array header and elements */
+size_t gs_array_size(gs_ArrayType type, int32_t len) {
+    return sizeof(gs_Array) + gs_array_elemsize(type) * len;
+}
+
+/* Initializes an array in a block of gs_array_size() bytes.  The elements are
+ * zeroed, and the whole array is marked dirty. */
+void gs_array_init(gs_Array* arr, gs_ArrayType type, int32_t len) {
+    arr->type = type;
+    arr->len = len;
+    arr->data = (char*)(arr+1);
+    memset(arr->data, 0, gs_array_elemsize(type) * len);
+    gs_array_touch(arr);
+}
+
+/* Returns element 'i' (zero-based) of the array */
+gs_Number gs_array_get(gs_Array const* arr, int32_t i) {
+    assert(i >= 0 && i < arr->len);
+    switch (arr->type) {
+    case gs_f32: return ((float const*)arr->data)[i];
+    case gs_f64: return ((double const*)arr->data)[i];
+    case gs_i32: return ((int32_t const*)arr->data)[i];
+    default: return 0;
+    }
+}
+
+/* Sets element 'i' (zero-based) of the array, and marks it dirty */
+void gs_array_set(gs_Array* arr, int32_t i, gs_Number num) {
+    assert(i >= 0 && i < arr->len);
+    switch (arr->type) {
+    case gs_f32: ((float*)arr->data)[i] = (float)num; break;
+    case gs_f64: ((double*)arr->data)[i] = num; break;
+    case gs_i32: ((int32_t*)arr->data)[i] = (int32_t)num; break;
+    default: break;
+    }
+    if (arr->dirty_first == arr->dirty_last) {
+        arr->dirty_first = i;
+        arr->dirty_last = i+1;
+    } else if (i < arr->dirty_first) {
+        arr->dirty_first = i;
+    } else if (i >= arr->dirty_last) {
+        arr->dirty_last = i+1;
+    }
+}
+
+/* Marks the whole array dirty */
+void gs_array_touch(gs_Array* arr) {
+    arr->dirty_first = 0;
+    arr->dirty_last = arr->len;
+}
+
+/* Marks the whole array clean */
+void gs_array_clean(gs_Array* arr) {
+    arr->dirty_first = 0;
+    arr->dirty_last = 0;
+}
+
+/* Copies a received range into the array.  The patch must have the same type
+ * and length as the array. */
+void gs_array_patch(gs_Array* arr, gs_ArrayPatch const* patch) {
+    size_t const size = gs_array_elemsize(arr->type);
+    assert(patch->type == arr->type && patch->len == arr->len);
+    assert(patch->first >= 0 && patch->first + patch->count <= arr->len);
+    gs_swapcpy(arr->data + patch->first*size, patch->data, patch->count, size);
+}
 
 /* LUA BINDINGS */
 
@@ -461,17 +1520,54 @@ static int gs_Lclose(lua_State* env) {
 static int gs_Llisten(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
     uint16_t port = (uint16_t)lua_tonumber(env, 2);
-    gs_listen(sd, port);
+    int backlog = (int)lua_tonumber(env, 3);
+    gs_listen(sd, port, backlog);
+    lua_settop(env, 0);
+    return 0;
+}
+
+static int gs_Lshm_socket(lua_State* env) {
+    lua_settop(env, 0);
+    lua_pushlightuserdata(env, gs_shm_socket()); 
+    return 1;
+}
+
+static int gs_Lshm_connect(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    char const* name = lua_tostring(env, 2);
+    gs_shm_connect(sd, name);
+    lua_settop(env, 0);
+    return 0;
+}
+
+static int gs_Lshm_listen(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    char const* name = lua_tostring(env, 2);
+    int backlog = (int)lua_tonumber(env, 3);
+    gs_shm_listen(sd, name, backlog);
     lua_settop(env, 0);
     return 0;
 }
 
 static int gs_Laccept(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
-    lua_pushlightuserdata(env, gs_accept(sd)); 
+    gs_Socket* ret = 0;
+    lua_settop(env, 0);
+    lua_newtable(env);
+    for (int i = 1; (ret = gs_accept(sd)); ++i) {
+        lua_pushlightuserdata(env, ret); 
+        lua_rawseti(env, 1, i);
+    }
     return 1;
 }
 
+static int gs_Lreserve(lua_State* env) {
+    int n = (int)lua_tonumber(env, 1);
+    lua_settop(env, 0);
+    gs_reserve(n);
+    return 0;
+}
+
 static int gs_Lpoll(lua_State* env) {
     int const wait = lua_toboolean(env, 2);
     int nsds = 0;
@@ -491,10 +1587,46 @@ static int gs_Lpoll(lua_State* env) {
     }
 
     gs_poll(sds, nsds, wait);
+    free(sds);
     lua_settop(env, 0);
     return 0;
 }
 
+static int gs_Ltimer(lua_State* env) {
+    lua_Number const delay = lua_tonumber(env, 1);
+    lua_Number const period = lua_tonumber(env, 2);
+    lua_settop(env, 0);
+    if (delay < 0 || period < 0) {
+        return luaL_error(env, "timer delay and period must not be negative");
+    }
+    lua_pushlightuserdata(env, gs_timer((gs_Time)(delay*1e6), (gs_Time)(period*1e6)));
+    return 1;
+}
+
+static int gs_Ltimer_cancel(lua_State* env) {
+    gs_Timer* timer = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    gs_timer_cancel(timer);
+    return 0;
+}
+
+static int gs_Lexpire(lua_State* env) {
+    gs_Timer* timer = 0;
+    lua_settop(env, 0);
+    lua_newtable(env);
+    for (int i = 1; (timer = gs_timer_expire()); ++i) {
+        lua_pushlightuserdata(env, timer); 
+        lua_rawseti(env, 1, i);
+    }
+    return 1;
+}
+
+static int gs_Lnow(lua_State* env) {
+    lua_settop(env, 0);
+    lua_pushnumber(env, gs_now() / 1e6);
+    return 1;
+}
+
 static int gs_Lsend_begin(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
     gs_send_begin(sd);
@@ -553,18 +1685,42 @@ static int gs_Lflush(lua_State* env) {
     return 0;
 }
 
+/* Lua strings may hold NULs, so they are sent with their length, as a buffer,
+ * rather than with gs_send_str */
 static int gs_Lsend_str(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
-    char const* str = lua_tostring(env, 2);
-    gs_send_str(sd, str);
+    size_t len = 0;
+    char const* str = lua_tolstring(env, 2, &len);
+    assert(len <= INT32_MAX);
+    gs_send_buf(sd, str, (int32_t)len);
+    lua_settop(env, 0);
+    return 0; 
+}
+
+static int gs_Lsend_buf(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    size_t len = 0;
+    char const* str = lua_tolstring(env, 2, &len);
+    size_t const first = (size_t)lua_tonumber(env, 3);
+    size_t const count = (size_t)lua_tonumber(env, 4);
+    assert(first >= 1 && first-1+count <= len && count <= INT32_MAX);
+    gs_send_buf(sd, str+first-1, (int32_t)count);
     lua_settop(env, 0);
     return 0; 
 }
 
+static int gs_Lsend_space(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushnumber(env, gs_send_space(sd));
+    return 1;
+}
+
 static int gs_Lsend_typeid(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
     gs_TypeId id = (gs_TypeId)lua_tonumber(env, 2);
-    assert(id == 'n' || id == 's' || id == 'b' || id == 't');
+    assert(id == 'n' || id == 's' || id == 'b' || id == 't' || id == 'S' || id == 'a'
+        || id == 'A' || id == 'x');
     gs_send_typeid(sd, id);
     lua_settop(env, 0);
     return 0;
@@ -573,7 +1729,7 @@ static int gs_Lsend_typeid(lua_State* env) {
 static int gs_Lsend_id(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
     lua_Number id = lua_tonumber(env, 2);
-    assert(id < UINT32_MAX && id >= 0);
+    assert(id <= UINT32_MAX && id >= 0);
     gs_send_id(sd, (gs_Id)id);
     lua_settop(env, 0);
     return 0;
@@ -587,17 +1743,52 @@ static int gs_Lsend_num(lua_State* env) {
     return 0;
 }
 
-static int gs_Lfetch(lua_State* env) {
+static int gs_Lsend_bool(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
+    int const val = lua_toboolean(env, 2);
+    gs_send_bool(sd, val);
     lua_settop(env, 0);
-    gs_fetch(sd);
     return 0;
 }
 
+static int gs_Lrecv_bool(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushboolean(env, gs_recv_bool(sd));
+    return 1;
+}
+
+static int gs_Lfetch(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushnumber(env, gs_fetch(sd));
+    return 1;
+}
+
+/* Receives a string sent with gs_Lsend_str */
 static int gs_Lrecv_str(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
+    int32_t len = 0;
+    char const* str = gs_recv_buf(sd, &len);
     lua_settop(env, 0);
-    lua_pushstring(env, gs_recv_str(sd));
+    if (str) {
+        lua_pushlstring(env, str, len);
+    } else {
+        lua_pushnil(env);
+    }
+    return 1; 
+}
+
+static int gs_Lrecv_buf(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    int32_t len = 0;
+    char const* buf = gs_recv_buf(sd, &len);
+    lua_settop(env, 0);
+    if (buf) {
+        lua_pushlstring(env, buf, len);
+    } else {
+        lua_pushnil(env);
+    }
     return 1; 
 }
 
@@ -622,6 +1813,229 @@ static int gs_Lrecv_num(lua_State* env) {
     return 1;
 }
 
+#define gs_arraymeta "gamesync.Array"
+
+/* Returns the array at 'index', or null if the value isn't an array */
+static gs_Array* gs_toarray(lua_State* env, int index) {
+    gs_Array* arr = lua_touserdata(env, index);
+    if (!arr || !lua_getmetatable(env, index)) {
+        return 0;
+    }
+    luaL_getmetatable(env, gs_arraymeta);
+    if (!lua_rawequal(env, -1, -2)) {
+        arr = 0;
+    }
+    lua_pop(env, 2);
+    return arr;
+}
+
+/* Pushes a new array onto the stack */
+static gs_Array* gs_newarray(lua_State* env, gs_ArrayType type, int32_t len) {
+    gs_Array* arr = lua_newuserdata(env, gs_array_size(type, len));
+    gs_array_init(arr, type, len);
+    luaL_getmetatable(env, gs_arraymeta);
+    lua_setmetatable(env, -2);
+    return arr;
+}
+
+static int gs_Larray(lua_State* env) {
+    char const* kind = lua_tostring(env, 1);
+    lua_Number const len = lua_tonumber(env, 2);
+    gs_ArrayType type = 0;
+    if (!kind) {
+        return luaL_error(env, "array type must be 'f32', 'f64', or 'i32'");
+    } else if (!strcmp(kind, "f32")) {
+        type = gs_f32;
+    } else if (!strcmp(kind, "f64")) {
+        type = gs_f64;
+    } else if (!strcmp(kind, "i32")) {
+        type = gs_i32;
+    } else {
+        return luaL_error(env, "array type must be 'f32', 'f64', or 'i32'");
+    }
+    if (len < 0 || len > INT32_MAX) {
+        return luaL_error(env, "bad array length");
+    }
+    lua_settop(env, 0);
+    gs_newarray(env, type, (int32_t)len);
+    return 1;
+}
+
+static int gs_Larray_index(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_Number const i = lua_tonumber(env, 2);
+    int const ok = lua_type(env, 2) == LUA_TNUMBER && i >= 1 && i <= arr->len;
+    lua_settop(env, 0);
+    if (ok) {
+        lua_pushnumber(env, gs_array_get(arr, (int32_t)i-1));
+    } else {
+        lua_pushnil(env);
+    }
+    return 1;
+}
+
+static int gs_Larray_newindex(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_Number const i = lua_tonumber(env, 2);
+    lua_Number const num = lua_tonumber(env, 3);
+    if (lua_type(env, 2) != LUA_TNUMBER || i < 1 || i > arr->len) {
+        return luaL_error(env, "array index out of range");
+    }
+    gs_array_set(arr, (int32_t)i-1, num);
+    lua_settop(env, 0);
+    return 0;
+}
+
+static int gs_Larray_len(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushnumber(env, arr->len);
+    return 1;
+}
+
+static int gs_Larray_type(lua_State* env) {
+    gs_Array* arr = gs_toarray(env, 1);
+    lua_settop(env, 0);
+    switch (arr ? arr->type : 0) {
+    case gs_f32: lua_pushstring(env, "f32"); break;
+    case gs_f64: lua_pushstring(env, "f64"); break;
+    case gs_i32: lua_pushstring(env, "i32"); break;
+    default: lua_pushnil(env); break;
+    }
+    return 1;
+}
+
+static int gs_Larray_elemsize(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushnumber(env, gs_array_elemsize(arr->type));
+    return 1;
+}
+
+static int gs_Larray_ptr(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushlightuserdata(env, arr->data);
+    return 1;
+}
+
+static int gs_Larray_dirty(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    lua_pushnumber(env, arr->dirty_first);
+    lua_pushnumber(env, arr->dirty_last - arr->dirty_first);
+    return 2;
+}
+
+static int gs_Larray_touch(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    gs_array_touch(arr);
+    return 0;
+}
+
+static int gs_Larray_clean(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    lua_settop(env, 0);
+    gs_array_clean(arr);
+    return 0;
+}
+
+/* Applies a patch returned by recv_array.  If 'arr' is nil or doesn't match
+ * the patch type/length, a new array is created.  Returns the array. */
+static int gs_Larray_patch(lua_State* env) {
+    gs_Array* arr = gs_toarray(env, 1);
+    gs_ArrayPatch patch;
+    patch.type = (gs_ArrayType)lua_tonumber(env, 2);
+    patch.len = (int32_t)lua_tonumber(env, 3);
+    patch.first = (int32_t)lua_tonumber(env, 4);
+    patch.count = (int32_t)lua_tonumber(env, 5);
+    patch.data = lua_touserdata(env, 6);
+    if (arr && arr->type == patch.type && arr->len == patch.len) {
+        lua_settop(env, 1);
+    } else {
+        lua_settop(env, 0);
+        arr = gs_newarray(env, patch.type, patch.len);
+    }
+    gs_array_patch(arr, &patch);
+    gs_array_clean(arr);
+    return 1;
+}
+
+static int gs_Lsend_array(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    gs_Array* arr = lua_touserdata(env, 2);
+    int32_t first = arr->dirty_first;
+    int32_t count = arr->dirty_last - arr->dirty_first;
+    if (!lua_isnoneornil(env, 3)) {
+        first = (int32_t)lua_tonumber(env, 3);
+        count = (int32_t)lua_tonumber(env, 4);
+    }
+    gs_send_array(sd, arr, first, count);
+    lua_settop(env, 0);
+    return 0;
+}
+
+/* Pushes the fields of a patch, as returned by recv_array and array_unpack */
+static int gs_pushpatch(lua_State* env, gs_ArrayPatch const* patch) {
+    lua_pushnumber(env, patch->type);
+    lua_pushnumber(env, patch->len);
+    lua_pushnumber(env, patch->first);
+    lua_pushnumber(env, patch->count);
+    lua_pushlightuserdata(env, (void*)patch->data);
+    return 5;
+}
+
+/* Returns nil if the block hasn't fully arrived, or false if it's invalid */
+static int gs_Lrecv_array(lua_State* env) {
+    gs_Socket* sd = lua_touserdata(env, 1);
+    gs_ArrayPatch patch;
+    int const ret = gs_recv_array(sd, &patch);
+    lua_settop(env, 0);
+    if (ret < 0) {
+        lua_pushboolean(env, 0);
+        return 1;
+    } else if (!ret) {
+        lua_pushnil(env);
+        return 1;
+    }
+    return gs_pushpatch(env, &patch);
+}
+
+/* Returns a string holding elements [first, first+count) of the array, in the
+ * same format as send_array, for sending as a stream */
+static int gs_Larray_pack(lua_State* env) {
+    gs_Array* arr = lua_touserdata(env, 1);
+    int32_t const first = (int32_t)lua_tonumber(env, 2);
+    int32_t const count = (int32_t)lua_tonumber(env, 3);
+    size_t const len = gs_arrayhdr + count*gs_array_elemsize(arr->type);
+    char* buf = malloc(len);
+    assert(buf);
+    gs_array_write(buf, arr, first, count);
+    lua_settop(env, 0);
+    lua_pushlstring(env, buf, len);
+    free(buf);
+    return 1;
+}
+
+/* Reads a string returned by array_pack.  Returns the same values as
+ * recv_array; the data points into the string.  Returns false if the string
+ * doesn't hold a valid block. */
+static int gs_Larray_unpack(lua_State* env) {
+    size_t len = 0;
+    char const* buf = lua_tolstring(env, 1, &len);
+    gs_ArrayPatch patch;
+    if (!buf || len < gs_arrayhdr || !gs_array_read(buf, &patch)
+        || (len - gs_arrayhdr) / gs_array_elemsize(patch.type) != (size_t)patch.count
+        || (len - gs_arrayhdr) % gs_array_elemsize(patch.type)) {
+        lua_settop(env, 0);
+        lua_pushboolean(env, 0);
+        return 1;
+    }
+    patch.data = buf + gs_arrayhdr;
+    return gs_pushpatch(env, &patch); /* the string stays at index 1 */
+}
+
 static int gs_Lstate(lua_State* env) {
     gs_Socket* sd = lua_touserdata(env, 1);
     lua_settop(env, 0);
@@ -657,7 +2071,15 @@ static const luaL_reg gamesync[] = {
     { "close", gs_Lclose },
     { "listen", gs_Llisten },
     { "accept", gs_Laccept },
+    { "reserve", gs_Lreserve },
+    { "shm_socket", gs_Lshm_socket },
+    { "shm_connect", gs_Lshm_connect },
+    { "shm_listen", gs_Lshm_listen },
     { "poll", gs_Lpoll },
+    { "timer", gs_Ltimer },
+    { "timer_cancel", gs_Ltimer_cancel },
+    { "expire", gs_Lexpire },
+    { "now", gs_Lnow },
     { "status", gs_Lstatus },
     { "writable", gs_Lwritable },
     { "readable", gs_Lreadable },
@@ -667,22 +2089,51 @@ static const luaL_reg gamesync[] = {
     { "flush", gs_Lflush },
     { "send_begin", gs_Lsend_begin },
     { "send_end", gs_Lsend_end },
+    { "send_space", gs_Lsend_space },
     { "send_str", gs_Lsend_str },
+    { "send_buf", gs_Lsend_buf },
     { "send_typeid", gs_Lsend_typeid },
     { "send_id", gs_Lsend_id },
     { "send_num", gs_Lsend_num },
+    { "send_bool", gs_Lsend_bool },
     { "recv_begin", gs_Lrecv_begin },
     { "recv_end", gs_Lrecv_end },
     { "recv_str", gs_Lrecv_str },
+    { "recv_buf", gs_Lrecv_buf },
     { "recv_typeid", gs_Lrecv_typeid },
     { "recv_id", gs_Lrecv_id },
     { "recv_num", gs_Lrecv_num },
+    { "recv_boolean", gs_Lrecv_bool },
+    { "send_array", gs_Lsend_array },
+    { "recv_array", gs_Lrecv_array },
+    { "array", gs_Larray },
+    { "array_type", gs_Larray_type },
+    { "array_elemsize", gs_Larray_elemsize },
+    { "array_ptr", gs_Larray_ptr },
+    { "array_dirty", gs_Larray_dirty },
+    { "array_touch", gs_Larray_touch },
+    { "array_clean", gs_Larray_clean },
+    { "array_patch", gs_Larray_patch },
+    { "array_pack", gs_Larray_pack },
+    { "array_unpack", gs_Larray_unpack },
+    { 0, 0 },
+};
+
+static const luaL_reg gamesync_array[] = {
+    { "__index", gs_Larray_index },
+    { "__newindex", gs_Larray_newindex },
+    { "__len", gs_Larray_len },
     { 0, 0 },
 };
 
 GAMESYNC_API int luaopen_lib_gamesync(lua_State *env) {
+    luaL_newmetatable(env, gs_arraymeta);
+    luaL_register(env, 0, gamesync_array);
+    lua_pop(env, 1);
     lua_newtable(env);
     luaL_register(env, 0, gamesync);
+    lua_pushnumber(env, gs_bufsize);
+    lua_setfield(env, -2, "bufsize");
     return 1;
 }
 
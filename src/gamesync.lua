@@ -24,6 +24,25 @@ local gs = {}
 gs.socket = {} -- array of sockets
 gs.table = { _id = 0 } -- list of root tables by path
 gs.next_id = 1 -- next ID to use for a table
+gs.atomic_id = 0xffffffff -- reserved table ID that marks a transaction frame
+gs.stream_id = 0xfffffffe -- reserved table ID that marks a stream fragment
+gs.open_id = 0xfffffffd -- reserved table ID that opens a stream for a frame
+gs.heartbeat_id = 0xfffffffc -- reserved table ID that marks a heartbeat
+gs.part_id = 0xfffffffb -- reserved table ID that marks part of a transaction
+gs.chunk_size = 8192 -- largest string sent in one message; larger ones stream
+gs.stream_reserve = 8192 -- write buffer space kept free of stream fragments
+gs.read_limit = 1048576 -- most bytes read from one socket per poll
+gs.txn = nil -- transaction being built by gs.atomic(), if any
+gs.array_field = setmetatable({}, { __mode = 'k' }) -- table field of each array
+gs.meta = setmetatable({}, { __mode = 'k' }) -- Metatable for each table
+gs.timers = {} -- callback for each timer
+gs.backoff_min = 0.1 -- first reconnect delay, in seconds
+gs.backoff_max = 10 -- longest reconnect delay, in seconds
+gs.heartbeat = 1 -- idle time before a heartbeat is sent, in seconds
+gs.idle_timeout = 5 -- silence before a connection is dropped, or nil to wait
+gs.keepalive_period = 0.25 -- how often heartbeats and timeouts are checked
+gs.keepalive = nil -- timer that sends heartbeats and checks timeouts
+gs.root = { id = 0 } -- stands in for the Metatable of gs.table
 
 local insert = table.insert
 
@@ -60,7 +79,10 @@ function gs.Metatable.new(table, channels)
     self.dirty = {}
     self.data = {}
     self.id = gs.next_id
+    self.pending = {} -- Keys written since the last tick, if rate-limited
+    self.timer = nil -- Tick timer, if rate-limited
     gs.next_id = gs.next_id+1
+    gs.meta[table] = self
 
 	assert(channels)
 
@@ -78,42 +100,242 @@ function gs.Metatable.new(table, channels)
     return self
 end
 
--- Serialize a value on all output channels if possible.  Add table to the
--- serialize list if there's no space in the output buffer.
+-- Serialize a value on all output channels.  If there's no space in the
+-- output buffer, or frames are already queued on the socket, the write is
+-- queued as a frame and sent from gs.poll once the buffer drains.  Inside of a
+-- gs.atomic() block, the write is added to the pending transaction instead.
+-- If the table is rate-limited (see gs.rate), the write waits for the tick,
+-- unless it is part of a transaction.  Sockets that are waiting to reconnect
+-- are skipped; they get the whole table again once they do (see resync).
 function gs.Metatable:send(key, value)
+    if gs.txn then
+        self.pending[key] = nil -- Sent with the transaction instead
+        gs.txn:add(self, key, value)
+        return
+    end
+    if self.timer then
+        self.pending[key] = true
+        return
+    end
+    if gsn.array_type(value) then
+        return self:send_array(key, value)
+    end
     for _, sd in ipairs(self.channels.output) do
-        gsn.send_begin(sd.sd)
-        gsn.send_id(sd.sd, self.id)
-        gsn.send_str(sd.sd, key) -- FIXME: Use an Atom table instead
-
-        if type(value) == 'string' then
-            gsn.send_typeid(sd.sd, string.byte('s'))
-            gsn.send_str(sd.sd, value)  
-            print('send', self.id, 's', key, value)
-        elseif type(value) == 'number' then
-            gsn.send_typeid(sd.sd, string.byte('n'))
-            gsn.send_num(sd.sd, value)
-            print('send', self.id, 'n', key, value)
-        elseif type(value) == 'table' then
-            gsn.send_typeid(sd.sd, string.byte('t'))
-            gsn.send_id(sd.sd, value.id)
-            print('send', self.id, 't', key, value)
-        elseif type(value) == 'boolean' then
-            gsn.send_typeid(sd.sd, string.byte('b'))
-            gsn.send_bool(sd.sd, value)
-            print('send', self.id, 'b', key, value)
-        else
-            error('invalid type')
+        if not sd.stale then
+            if #sd.queue > 0 or not sd:send_field(self, key, value) then
+                local frame = gs.Frame.new()
+                frame:add(self, key, value)
+                sd:send_frame(frame)
+            end
+            gsn.flush(sd.sd)
         end
-        if not gsn.send_end(sd.sd) then
-            -- Not enough space. Add the table to the wait list 
-            insert(sd.dirty, table)
+    end
+end
+
+-- Send the fields written since the last tick as one transaction.  Deleted
+-- fields are sent as nil.
+function gs.Metatable:tick()
+    if not next(self.pending) then
+        return
+    end
+    local txn = gs.Transaction.new()
+    for key in pairs(self.pending) do
+        txn:add(self, key, rawget(self.data, key))
+    end
+    self.pending = {}
+    txn:commit()
+end
+
+-- Serialize the dirty range of a packed array on all output channels.  Large
+-- ranges are split into blocks of at most gs.chunk_size bytes, and each block
+-- is sent as its own message.  If a block doesn't fit in the write buffer, the
+-- rest of the range is queued on that socket, so the array can be marked clean.
+function gs.Metatable:send_array(key, array)
+    local first, count = gsn.array_dirty(array)
+    local step = math.max(1, math.floor(gs.chunk_size/gsn.array_elemsize(array)))
+    for _, sd in ipairs(self.channels.output) do
+        local i = first
+        repeat
+            local n = math.min(step, first+count-i)
+            if sd.stale then
+                break -- Sent whole by gs.Socket:resync
+            elseif #sd.queue > 0 or not sd:send_field(self, key, array, i, n) then
+                local frame = gs.Frame.new()
+                frame:add(self, key, array, i, first+count-i)
+                sd:send_frame(frame)
+                break
+            end
+            i = i+n
+        until i >= first+count
+        if not sd.stale then
+            gsn.flush(sd.sd)
         end
-        gsn.flush(sd.sd)
     end
+    gsn.array_clean(array)
+end
+
+-- The gs.Frame table holds writes that are sent to one socket as a single
+-- transaction frame.  Writes are grouped by table, so that each table id is
+-- only sent once.
+gs.Frame = {}
+gs.Frame.__index = gs.Frame
+
+-- Creates a new, empty frame.
+function gs.Frame.new()
+    local self = {}
+    setmetatable(self, gs.Frame)
+    self.group = {} -- Group of writes for each table
+    self.order = {} -- Groups in the order they were first written
+    self.streams = {} -- Streams that must be sent before the frame
+    return self
 end
 
+-- Record a write to the table owned by 'mt'.  If the same key is written more
+-- than once, only the last value is sent.  For packed arrays, elements [first,
+-- first+count) are sent, or the dirty range if 'first' is nil.
+function gs.Frame:add(mt, key, value, first, count)
+    local group = self.group[mt]
+    if not group then
+        group = { mt = mt, field = {}, index = {} }
+        self.group[mt] = group
+        insert(self.order, group)
+    end
+    local i = group.index[key]
+    if not i then
+        i = #group.field+1
+        group.index[key] = i
+    end
+    group.field[i] = { key = key, value = value, first = first, count = count }
+end
 
+-- Fix the range of each packed array in the frame to the current dirty range,
+-- so that a queued frame still sends the range after the array is cleaned.
+function gs.Frame:pin()
+    for _, group in ipairs(self.order) do
+        for _, field in ipairs(group.field) do
+            if gsn.array_type(field.value) and not field.first then
+                field.first, field.count = gsn.array_dirty(field.value)
+            end
+        end
+    end
+end
+
+-- Returns the number of bytes the frame takes up in the write buffer.
+function gs.Frame:size()
+    local size = 8 -- atomic id, group count
+    for _, group in ipairs(self.order) do
+        size = size+8 -- table id, field count
+        for _, field in ipairs(group.field) do
+            size = size+gs.field_size(field.key, field.value, field.count)
+        end
+    end
+    return size
+end
+
+-- Returns the number of bytes a write to field 'key' takes up in a frame.  For
+-- packed arrays, 'count' elements are sent, or the dirty range if it is nil.
+function gs.field_size(key, value, count)
+    local size = 4+#key+1 -- key, typeid
+    if gsn.array_type(value) then
+        count = count or select(2, gsn.array_dirty(value))
+        local bytes = count*gsn.array_elemsize(value)
+        return size+(bytes > gs.chunk_size and 8 or 13+bytes)
+    elseif type(value) == 'string' and #value > gs.chunk_size then
+        return size+8 -- stream header
+    elseif type(value) == 'string' then
+        return size+4+#value
+    elseif type(value) == 'number' then
+        return size+8
+    elseif type(value) == 'boolean' then
+        return size+1
+    elseif value == nil then
+        return size
+    else
+        return size+4
+    end
+end
+
+-- The gs.Transaction table collects the writes made inside of a gs.atomic()
+-- block.  On commit, each socket receives a frame holding every write.  If the
+-- writes don't fit in the write buffer, they are split over several frames;
+-- all but the last are sent as parts, which the remote side holds until the
+-- last frame arrives, so that the transaction is still applied at once.
+gs.Transaction = {}
+gs.Transaction.__index = gs.Transaction
+
+-- Creates a new, empty transaction.
+function gs.Transaction.new()
+    local self = {}
+    setmetatable(self, gs.Transaction)
+    self.frames = {} -- Pending frames for each socket
+    self.size = {} -- Estimated size of the last frame for each socket
+    self.socket = {} -- Sockets in the order they were first written
+    return self
+end
+
+-- Record a write to the table owned by 'mt' in the frame of each of the
+-- table's output sockets.  Sockets waiting to reconnect are skipped.
+function gs.Transaction:add(mt, key, value)
+    for _, sd in ipairs(mt.channels.output) do
+        if not sd.stale then
+            self:write(sd, mt, key, value)
+        end
+    end
+end
+
+-- Record a write to the table owned by 'mt' in the frame for socket 'sd'.  For
+-- packed arrays, elements [first, first+count) are sent, or the dirty range if
+-- 'first' is nil.
+function gs.Transaction:write(sd, mt, key, value, first, count)
+    local frames = self.frames[sd]
+    if not frames then
+        frames = { gs.Frame.new() }
+        self.frames[sd] = frames
+        self.size[sd] = 8 -- atomic id, group count
+        insert(self.socket, sd)
+    end
+    local size = 8+gs.field_size(key, value, count) -- at most one new group
+    if self.size[sd]+size > gsn.bufsize then
+        frames[#frames].part = true -- Held by the remote side until the last
+        insert(frames, gs.Frame.new())
+        self.size[sd] = 8
+    end
+    self.size[sd] = self.size[sd]+size
+    frames[#frames]:add(mt, key, value, first, count)
+end
+
+-- Send the frames of the transaction to each socket, and flush each socket
+-- once.  Raises an error, before anything is sent, if a single write is larger
+-- than the whole write buffer.  Packed arrays sent with their dirty range are
+-- cleaned.
+function gs.Transaction:commit()
+    local clean = {}
+    for _, sd in ipairs(self.socket) do
+        for _, frame in ipairs(self.frames[sd]) do
+            for _, group in ipairs(frame.order) do
+                for _, field in ipairs(group.field) do
+                    if gsn.array_type(field.value) and not field.first then
+                        clean[field.value] = true
+                    end
+                end
+            end
+            frame:pin()
+            local size = frame:size()
+            if size > gsn.bufsize then
+                error('write too large ('..size..' bytes)', 0)
+            end
+        end
+    end
+    for _, sd in ipairs(self.socket) do
+        for _, frame in ipairs(self.frames[sd]) do
+            sd:send_frame(frame)
+        end
+        gsn.flush(sd.sd)
+    end
+    for array in pairs(clean) do
+        gsn.array_clean(array)
+    end
+end
 
 -- Called when a user data table is changed.  Check if the write is idempotent.
 -- If not, serialize the write.
@@ -121,12 +343,21 @@ function gs.Metatable:newindex(key, value)
     if rawget(self.data, key) == value then
         return
     end
-    rawset(self.data, key, value)
     if key:sub(1,1) == '_' then
+        rawset(self.data, key, value)
         return
     end
+    local kind = type(value)
+    if kind ~= 'nil' and kind ~= 'string' and kind ~= 'number' 
+        and kind ~= 'boolean' and kind ~= 'table' and not gsn.array_type(value) then
+        error('invalid type') -- Raise before anything is written
+    end
+    rawset(self.data, key, value)
     if type(value) == 'table' then
         gs.Metatable.new(value, self.channels)
+    elseif gsn.array_type(value) then
+        gsn.array_touch(value)
+        gs.array_field[value] = { mt = self, key = key }
     end
     self:send(key, value)
 end
@@ -150,10 +381,26 @@ gs.Socket.__index = gs.Socket
 function gs.Socket.new()
     local self = {}
     setmetatable(self, gs.Socket)
-    self.dirty = {} -- Tables that need be written to output
+    self.paths = {} -- Paths of the root tables opened over this socket
+    self.next_stream = 1 -- next ID to use for an outgoing stream
+    self:reset()
+    return self
+end
+
+-- Forget the state of the previous connection.  Anything that was queued or
+-- half-received is dropped; gs.Socket:resync sends the tables again.
+function gs.Socket:reset()
+    self.queue = {} -- Frames waiting for space in the write buffer
     self.table = {} -- Tables listed by opposite endpoint id
     self.table[0] = gs.table
-    return self
+    self.stream = {} -- Outgoing streams, in the order they were started
+    self.new_stream = {} -- Streams started by the message being sent
+    self.new_write = {} -- Fields written by the message being sent
+    self.incoming = {} -- Incoming streams, by stream id
+    self.partial = {} -- Writes received in parts of a transaction
+    self.connected = false -- True once the connect is confirmed
+    self.last_recv = gsn.now() -- Time the last bytes arrived
+    self.last_send = gsn.now() -- Time the last message was written
 end
 
 -- Reconnect the socket to the endpoint.
@@ -161,43 +408,361 @@ function gs.Socket:connect(host, port)
     if self.sd then
         self:close()
     end
+    self:reset()
     self.sd = gsn.socket()
     gsn.connect(self.sd, host, port)
 end
 
 -- Listen on a port
-function gs.Socket:listen(port)
+function gs.Socket:listen(port, backlog)
     self.sd = gsn.socket()
-    gsn.listen(self.sd, port)
+    gsn.listen(self.sd, port, backlog)
+end
+
+-- Connect over shared memory to the process listening on 'name'
+function gs.Socket:connect_shm(name)
+    if self.sd then
+        self:close()
+    end
+    self:reset()
+    self.sd = gsn.shm_socket()
+    gsn.shm_connect(self.sd, name)
+end
+
+-- Listen for shared memory connections on 'name'
+function gs.Socket:listen_shm(name, backlog)
+    self.sd = gsn.shm_socket()
+    gsn.shm_listen(self.sd, name, backlog)
 end
 
--- Accept
+-- Accept every pending connection, and return a list of the new sockets
 function gs.Socket:accept()
-    local ret = gs.Socket.new()
-    ret.sd = gsn.accept(self.sd)
+    local ret = {}
+    for _, sd in ipairs(gsn.accept(self.sd)) do
+        local sock = gs.Socket.new()
+        sock.sd = sd
+        sock.accepted = true
+        insert(ret, sock)
+    end
     return ret
 end
 
+-- Reconnect after a connection error.  The delay starts at gs.backoff_min, and
+-- doubles after each failed attempt up to gs.backoff_max.
+function gs.Socket:reconnect_later()
+    if self.reconnect or not self.host then
+        return
+    end
+    self.backoff = math.min((self.backoff or gs.backoff_min/2)*2, gs.backoff_max)
+    self.reconnect = gs.after(self.backoff, function()
+        self.reconnect = nil
+        if self.shm then
+            self:connect_shm(self.host)
+        else
+            self:connect(self.host, self.port)
+        end
+    end)
+end
+
+-- Send the root table handshake for 'path', which tells the remote side to
+-- list 'table' in its gs.table under the same path.
+function gs.Socket:handshake(path, table)
+    local frame = gs.Frame.new()
+    frame:add(gs.root, path, table)
+    self:send_frame(frame)
+    gsn.flush(self.sd)
+end
+
+-- Send the handshake and every field of each root table opened over this
+-- socket, including nested tables and whole packed arrays, after a reconnect.
+-- The fields are sent as one transaction, so the remote side never sees a
+-- table that is only partly restored.  Parent tables are sent before the
+-- tables nested in them.
+function gs.Socket:resync()
+    self.stale = nil
+    local txn = gs.Transaction.new()
+    local seen = {}
+    local nested = {}
+    local function visit(mt)
+        if seen[mt] then
+            return
+        end
+        seen[mt] = true
+        for key, value in pairs(mt.data) do
+            if key:sub(1,1) == '_' then
+                -- Local-only field
+            elseif gsn.array_type(value) then
+                txn:write(self, mt, key, value, 0, #value)
+            else
+                txn:write(self, mt, key, value)
+                if type(value) == 'table' and gs.meta[value] then
+                    insert(nested, gs.meta[value])
+                end
+            end
+        end
+    end
+    for _, path in ipairs(self.paths) do
+        local table = gs.table[path]
+        txn:write(self, gs.root, path, table)
+        insert(nested, gs.meta[table])
+    end
+    local i = 1
+    while nested[i] do
+        visit(nested[i])
+        i = i+1
+    end
+    txn:commit()
+end
+
+-- Send a heartbeat if nothing was sent for gs.heartbeat seconds, so that the
+-- remote side doesn't time the connection out.  The heartbeat is skipped if
+-- the write buffer is full, since the buffer holds data for the remote side.
+function gs.Socket:heartbeat()
+    local sd = self.sd
+    gsn.send_begin(sd)
+    gsn.send_id(sd, gs.heartbeat_id)
+    if gsn.send_end(sd) then
+        self.last_send = gsn.now()
+    end
+    gsn.flush(sd)
+end
+
 -- Disconnect the socket from the endpoint.
 function gs.Socket:close()
     gsn.close(self.sd)
     self.sd = nil
 end
 
--- Receive a message from the socket.  If the whole message can't be read, try
--- again later when more bytes are available. 
-function gs.Socket:recv()
+-- Serialize a write to field 'key' of the table owned by 'mt' as a single
+-- message.  Returns false if the message didn't fit in the write buffer.
+function gs.Socket:send_field(mt, key, value, first, count)
     local sd = self.sd
-    gsn.recv_begin(sd)
+    gsn.send_begin(sd)
+    gsn.send_id(sd, mt.id)
+    gsn.send_str(sd, key) -- FIXME: Use an Atom table instead
+    self:send_value(value, mt.id, key, first, count)
+    return self:send_end()
+end
 
-    local id = gsn.recv_id(sd)
-    local key = gsn.recv_str(sd)
+-- Serialize a transaction frame.  Frame layout: atomic id (or part id, for all
+-- but the last frame of a large transaction), group count, then for each group
+-- the table id, field count, and the key/typeid/value of each field.  Returns
+-- false if the frame didn't fit in the write buffer, or if the streams it
+-- refers to haven't been sent yet.
+function gs.Socket:write_frame(frame)
+    local sd = self.sd
+    for _, stream in ipairs(frame.streams) do
+        if stream.offset < #stream.value then
+            return false
+        end
+    end
+    gsn.send_begin(sd)
+    gsn.send_id(sd, frame.part and gs.part_id or gs.atomic_id)
+    gsn.send_id(sd, #frame.order)
+    for _, group in ipairs(frame.order) do
+        gsn.send_id(sd, group.mt.id)
+        gsn.send_id(sd, #group.field)
+        for _, field in ipairs(group.field) do
+            local id, key, value = group.mt.id, field.key, field.value
+            gsn.send_str(sd, key)
+            if field.stream then
+                insert(self.new_write, { table = id, key = key })
+                gsn.send_typeid(sd, string.byte(field.stream.typeid))
+                gsn.send_id(sd, field.stream.id)
+                gsn.send_id(sd, #field.stream.value)
+            else
+                self:send_value(value, id, key, field.first, field.count)
+            end
+        end
+    end
+    return self:send_end()
+end
+
+-- Send a frame after the frames already queued on the socket.  If it doesn't
+-- fit in the write buffer, it stays queued, and gs.poll sends it once the
+-- buffer drains.  Strings and array ranges larger than gs.chunk_size are
+-- streamed ahead of the frame, and the frame is sent after their last
+-- fragment, so that the remote side can still apply the whole frame at once.
+-- Parts stream every array range, since the remote side holds on to the part
+-- after its read buffer is reused.
+function gs.Socket:send_frame(frame)
+    frame:pin()
+    for _, group in ipairs(frame.order) do
+        for _, field in ipairs(group.field) do
+            local value = field.value
+            if type(value) == 'string' and #value > gs.chunk_size then
+                field.stream = self:open_stream(value, 'S')
+                insert(frame.streams, field.stream)
+            elseif gsn.array_type(value) and (frame.part
+                or field.count*gsn.array_elemsize(value) > gs.chunk_size) then
+                local block = gsn.array_pack(value, field.first, field.count)
+                field.stream = self:open_stream(block, 'A')
+                insert(frame.streams, field.stream)
+            end
+        end
+    end
+    insert(self.queue, frame)
+    self:send_queue()
+end
+
+-- Start sending 'value' as a stream that isn't tied to a field.  The stream is
+-- opened on the remote side with a message marked by gs.open_id, and is
+-- picked up by the frame that refers to it with 'typeid': 'S' for a string, or
+-- 'A' for a packed array block.  Returns the stream.
+function gs.Socket:open_stream(value, typeid)
+    local stream = { id = self.next_stream, value = value, offset = 0 }
+    stream.typeid = typeid
+    stream.detached = true
+    self.next_stream = self.next_stream+1
+    insert(self.stream, stream)
+    return stream
+end
+
+-- Send queued frames, in order, flushing the write buffer whenever the next
+-- frame doesn't fit, until the socket can't take any more.
+function gs.Socket:send_queue()
+    while #self.queue > 0 do
+        if self:write_frame(self.queue[1]) then
+            table.remove(self.queue, 1)
+        else
+            local space = gsn.send_space(self.sd)
+            gsn.flush(self.sd)
+            if gsn.send_space(self.sd) == space then
+                return -- Wait for the write buffer to drain
+            end
+        end
+    end
+end
+
+-- Serialize the typeid and value of field 'key' of table 'id'.  The caller is
+-- responsible for the send_begin checkpoint, and must finish the message with
+-- gs.Socket:send_end.  Returns the typeid.  Strings larger than gs.chunk_size
+-- are sent as a stream header; the string itself follows in fragments.  For
+-- packed arrays, elements [first, first+count) are sent (zero-based), or the
+-- dirty range if 'first' is nil.  A deleted field (nil) is sent as typeid 'x'.
+function gs.Socket:send_value(value, id, key, first, count)
+    local sd = self.sd
+    insert(self.new_write, { table = id, key = key })
+    if gsn.array_type(value) then
+        gsn.send_typeid(sd, string.byte('a'))
+        gsn.send_array(sd, value, first, count)
+        return 'a'
+    elseif type(value) == 'string' and #value > gs.chunk_size then
+        local stream = { id = self.next_stream, table = id, key = key }
+        stream.value = value
+        stream.offset = 0
+        self.next_stream = self.next_stream+1
+        gsn.send_typeid(sd, string.byte('S'))
+        gsn.send_id(sd, stream.id)
+        gsn.send_id(sd, #value)
+        insert(self.new_stream, stream)
+        return 'S'
+    elseif type(value) == 'string' then
+        gsn.send_typeid(sd, string.byte('s'))
+        gsn.send_str(sd, value)  
+        return 's'
+    elseif type(value) == 'number' then
+        gsn.send_typeid(sd, string.byte('n'))
+        gsn.send_num(sd, value)
+        return 'n'
+    elseif type(value) == 'table' then
+        gsn.send_typeid(sd, string.byte('t'))
+        gsn.send_id(sd, value.id)
+        return 't'
+    elseif type(value) == 'boolean' then
+        gsn.send_typeid(sd, string.byte('b'))
+        gsn.send_bool(sd, value)
+        return 'b'
+    elseif value == nil then
+        gsn.send_typeid(sd, string.byte('x')) -- Deleted field
+        return 'x'
+    else
+        error('invalid type')
+    end
+end
+
+-- Finish sending a message.  If the message fit in the write buffer, start
+-- sending the streams it refers to.  Any stream already sending to a field
+-- the message wrote is cancelled, since its value is now stale.
+function gs.Socket:send_end()
+    local ok = gsn.send_end(self.sd)
+    if ok then
+        self.last_send = gsn.now()
+        for _, write in ipairs(self.new_write) do
+            for i = #self.stream, 1, -1 do
+                local stream = self.stream[i]
+                if stream.table == write.table and stream.key == write.key then
+                    table.remove(self.stream, i)
+                end
+            end
+        end
+        for _, stream in ipairs(self.new_stream) do
+            insert(self.stream, stream)
+        end
+    end
+    self.new_write = {}
+    self.new_stream = {}
+    return ok
+end
+
+-- Send stream fragments while there is room in the write buffer.  Space for
+-- gs.stream_reserve bytes is always left free, so that small updates on the
+-- same connection are never blocked behind a large value.  Streams take turns
+-- sending one fragment each.
+function gs.Socket:send_streams()
+    local sd = self.sd
+    while #self.stream > 0 do
+        for i = #self.stream, 1, -1 do
+            local space = gsn.send_space(sd) - gs.stream_reserve
+            if space < gs.chunk_size + 16 then
+                return -- Wait for the write buffer to drain
+            end
+            local stream = self.stream[i]
+            local count = math.min(gs.chunk_size, #stream.value-stream.offset)
+            gsn.send_begin(sd)
+            if stream.detached and stream.offset == 0 then
+                gsn.send_id(sd, gs.open_id)
+                gsn.send_id(sd, stream.id)
+                gsn.send_id(sd, #stream.value)
+            end
+            gsn.send_id(sd, gs.stream_id)
+            gsn.send_id(sd, stream.id)
+            gsn.send_buf(sd, stream.value, stream.offset+1, count)
+            if not gsn.send_end(sd) then
+                return
+            end
+            self.last_send = gsn.now()
+            stream.offset = stream.offset+count
+            if stream.offset == #stream.value then
+                table.remove(self.stream, i)
+            end
+        end
+        gsn.flush(sd)
+    end
+end
+
+-- Deserialize the typeid and value of a field.  Returns the typeid and value.
+-- For a stream header ('S'), the value is a descriptor for the incoming
+-- stream, and for a packed array ('a') it is the received range of elements.
+function gs.Socket:recv_value()
+    local sd = self.sd
     local typeid = string.char(gsn.recv_typeid(sd)) 
     local value
     if typeid == 's' then
         value = gsn.recv_str(sd) 
+    elseif typeid == 'S' or typeid == 'A' then
+        local id = gsn.recv_id(sd)
+        local len = gsn.recv_id(sd)
+        value = { id = id, len = len, size = 0, piece = {} }
     elseif typeid == 'n' then
         value = gsn.recv_num(sd)
+    elseif typeid == 'a' then
+        local kind, len, first, count, ptr = gsn.recv_array(sd)
+        if kind == false then
+            error('invalid array')
+        end
+        value = { type = kind, len = len, first = first, count = count }
+        value.ptr = ptr
     elseif typeid == 't' then
         local tableid = gsn.recv_id(sd)
         value = self.table[tableid]
@@ -206,23 +771,179 @@ function gs.Socket:recv()
             local channels = gs.Channels.new()
             local mt = gs.Metatable.new(value, channels, tableid)
             self.table[tableid] = value
-            insert(channels.output, sd)
+            channels.input = self
         end
     elseif typeid == 'b' then
         value = gsn.recv_boolean(sd)
+    elseif typeid == 'x' then
+        value = nil
     elseif typeid == '\0' then
         -- Socket is possibly borked
     else
         error('invalid typeid')
     end
+    return typeid, value
+end
+
+-- Apply a received write to field 'key' of table 'id'.  A stream header
+-- doesn't change the field; the field is set once the last fragment of the
+-- stream arrives.  A newer write to the same field drops the stream.  Array
+-- ranges are copied into the existing array if its type and length match.
+function gs.Socket:apply(id, key, typeid, value)
+    local table = self.table[id]
+    assert(table, 'unknown table id #'..id)
+    for sid, stream in pairs(self.incoming) do
+        if stream.table == id and stream.key == key then
+            self.incoming[sid] = nil
+        end
+    end
+    if typeid == 'S' then
+        value.table = id
+        value.key = key
+        self.incoming[value.id] = value
+    elseif typeid == 'a' then
+        local array = gsn.array_patch(table[key], value.type, value.len, 
+            value.first, value.count, value.ptr)
+        table[key] = array
+    else
+        table[key] = value
+    end
+end
+
+-- Receive a message from the socket.  If the whole message can't be read, try
+-- again later when more bytes are available.  Returns true if a message was
+-- received.
+function gs.Socket:recv()
+    local sd = self.sd
+    gsn.recv_begin(sd)
+
+    local id = gsn.recv_id(sd)
+    if id == gs.atomic_id then
+        return self:recv_atomic()
+    elseif id == gs.part_id then
+        return self:recv_atomic(true)
+    elseif id == gs.stream_id then
+        return self:recv_fragment()
+    elseif id == gs.open_id then
+        return self:recv_open()
+    elseif id == gs.heartbeat_id then
+        return gsn.recv_end(sd)
+    end
+    local key = gsn.recv_str(sd)
+    local typeid, value = self:recv_value()
     
     if not gsn.recv_end(sd) then
-        return -- Couldn't read the whole message
+        return false -- Couldn't read the whole message
     end
-    local table = self.table[id]
-    assert(table, 'unknown table id #'..id)
-    table[key] = value
-    print('recv', id, typeid, key, value)
+    self:apply(id, key, typeid, value)
+    return true
+end
+
+-- Receive a transaction frame (see gs.Socket:write_frame).  None of the writes
+-- are applied until the whole frame has been read, so readers never observe
+-- a partially-applied transaction.  Streamed fields in the frame refer to
+-- streams that were opened with gs.open_id, and have already arrived.  If
+-- 'part' is true, the frame is part of a larger transaction, and its writes
+-- are held until the last frame of the transaction arrives.
+function gs.Socket:recv_atomic(part)
+    local sd = self.sd
+    local write = {}
+    local ngroups = gsn.recv_id(sd)
+    for i = 1, ngroups do
+        local id = gsn.recv_id(sd)
+        local nfields = gsn.recv_id(sd)
+        for j = 1, nfields do
+            local key = gsn.recv_str(sd)
+            local typeid, value = self:recv_value()
+            if part and typeid == 'a' then
+                error('invalid array') -- Points into the read buffer
+            end
+            insert(write, { id = id, key = key, typeid = typeid, value = value })
+        end
+    end
+
+    if not gsn.recv_end(sd) then
+        return false -- Couldn't read the whole frame
+    end
+    if part then
+        for _, w in ipairs(write) do
+            insert(self.partial, w)
+        end
+        return true
+    elseif #self.partial > 0 then
+        for _, w in ipairs(write) do
+            insert(self.partial, w)
+        end
+        write, self.partial = self.partial, {}
+    end
+    for _, w in ipairs(write) do
+        assert(self.table[w.id], 'unknown table id #'..w.id)
+        if w.typeid == 'S' or w.typeid == 'A' then
+            local stream = self.incoming[w.value.id]
+            if not stream or not stream.detached or stream.size ~= stream.len then
+                error('invalid stream #'..w.value.id)
+            end
+        end
+    end
+    for _, w in ipairs(write) do
+        if w.typeid == 'S' then
+            local stream = self.incoming[w.value.id]
+            self.incoming[w.value.id] = nil
+            w.typeid, w.value = 's', table.concat(stream.piece)
+        elseif w.typeid == 'A' then
+            local stream = self.incoming[w.value.id]
+            self.incoming[w.value.id] = nil
+            local block = table.concat(stream.piece)
+            local kind, len, first, count, ptr = gsn.array_unpack(block)
+            if kind == false then
+                error('invalid array')
+            end
+            w.typeid = 'a'
+            w.value = { type = kind, len = len, first = first, count = count }
+            w.value.ptr = ptr
+            w.value.block = block -- Keeps 'ptr' valid
+        end
+    end
+    for _, w in ipairs(write) do
+        self:apply(w.id, w.key, w.typeid, w.value)
+    end
+    return true
+end
+
+-- Receive the start of a stream for a transaction frame.  The stream isn't tied
+-- to a field; the frame that refers to it applies it.
+function gs.Socket:recv_open()
+    local sd = self.sd
+    local id = gsn.recv_id(sd)
+    local len = gsn.recv_id(sd)
+    if not gsn.recv_end(sd) then
+        return false -- Couldn't read the whole message
+    end
+    local stream = { id = id, len = len, size = 0, piece = {} }
+    stream.detached = true
+    self.incoming[id] = stream
+    return true
+end
+
+-- Receive one fragment of a stream.  Fragments are collected until the whole
+-- value has arrived, and then joined and applied.  Streams opened for a frame
+-- wait for the frame instead.  Fragments for a dropped stream are ignored.
+function gs.Socket:recv_fragment()
+    local sd = self.sd
+    local id = gsn.recv_id(sd)
+    local piece = gsn.recv_buf(sd)
+    if not gsn.recv_end(sd) then
+        return false -- Couldn't read the whole fragment
+    end
+    local stream = self.incoming[id]
+    if stream then
+        insert(stream.piece, piece)
+        stream.size = stream.size+#piece
+        if stream.size >= stream.len and not stream.detached then
+            self:apply(stream.table, stream.key, 's', table.concat(stream.piece))
+        end
+    end
+    return true
 end
 
 
@@ -240,7 +961,9 @@ function gs.uri(uri)
 
     first, last = uri:find('^.+:', pos)
     if first == nil then
-        host = '' 
+        first, last = uri:find('^[^/]*', pos) -- host without a port
+        host = uri:sub(first, last)
+        pos = last + 1
     else
         host = uri:sub(first, last-1)
         pos = last + 1
@@ -283,18 +1006,27 @@ function gs.open(src)
     
     if scheme == 'local' then
         -- Do nothing
-    elseif scheme == 'gs' then
-        -- Connect
-        local name = host..':'..port
-        sd = gs.socket[name]
+    elseif scheme == 'gs' or scheme == 'shm' then
+        -- Connect.  shm://name connects over shared memory to a process on
+        -- the same host that called gs.listen('shm://name').
+        local name = scheme == 'gs' and host..':'..port or 'shm://'..host
+        local sd = gs.socket[name]
         if not sd then
             sd = gs.Socket.new()
             sd.host = host
             sd.port = port
-            sd:connect(host, port)
+            sd.shm = scheme == 'shm'
+            if scheme == 'shm' then
+                sd:connect_shm(host)
+            else
+                sd:connect(host, port)
+            end
             gs.socket[name] = sd
-            insert(channels.output, sd)
-            mt:send(path, table)
+        end
+        insert(channels.output, sd)
+        insert(sd.paths, path)
+        if not sd.stale then
+            sd:handshake(path, table)
         end
     else
         return nil, 'error: bad scheme'
@@ -302,41 +1034,218 @@ function gs.open(src)
     return table
 end
 
--- Listen on the given port
-function gs.listen(port)
+-- Listen on the given port, or on 'shm://name' for processes on the same host.
+-- 'backlog' is the number of connections the OS queues before accept; it
+-- defaults to the OS maximum.
+function gs.listen(port, backlog)
     local sd = gs.Socket.new()
-    sd:listen(port) 
+    local name = type(port) == 'string' and port:match('^shm://([^/]+)$')
+    if name then
+        sd:listen_shm(name, backlog)
+    else
+        sd:listen(port, backlog) 
+    end
     gs.socket[port] = sd
 end
 
+-- Run 'fn', buffering every table write it makes.  When 'fn' returns, the
+-- writes are sent as a single frame per connection, and the remote side
+-- applies them all at once.  Nested calls join the outermost transaction.
+function gs.atomic(fn)
+    if gs.txn then
+        return fn()
+    end
+    local txn = gs.Transaction.new()
+    gs.txn = txn
+    local ok, err = pcall(fn)
+    gs.txn = nil
+    txn:commit() -- Local state already changed; keep the remote side in sync
+    if not ok then
+        error(err, 0)
+    end
+end
+
+-- Create a packed array of 'len' numbers, all zero.  'kind' is 'f32', 'f64',
+-- or 'i32'.  When stored in a table, the array is sent as one block, and after
+-- that only the range of elements that changed is sent on each poll.
+function gs.array(kind, len)
+    return gsn.array(kind, len)
+end
+
+-- Return a pointer to the elements of a packed array, for use with the LuaJIT
+-- FFI: ffi.cast('double*', gs.pointer(array)).  Writes made through the
+-- pointer aren't tracked; call gs.touch(array) to send them.
+function gs.pointer(array)
+    return gsn.array_ptr(array)
+end
+
+-- Mark every element of a packed array as changed.
+function gs.touch(array)
+    gsn.array_touch(array)
+end
+
+-- Send the changed range of every packed array that is stored in a table.
+function gs.send_arrays()
+    for array, field in pairs(gs.array_field) do
+        if rawget(field.mt.data, field.key) ~= array then
+            gs.array_field[array] = nil -- No longer stored in the table
+        else
+            local first, count = gsn.array_dirty(array)
+            if count > 0 then
+                field.mt:send(field.key, array)
+            end
+        end
+    end
+end
+
+-- Preallocate 'n' connections, so that accepting a burst of clients (e.g.,
+-- when they all reconnect after a server restart) doesn't allocate.
+function gs.reserve(n)
+    gsn.reserve(n)
+end
+
+-- Call 'fn' once, after 'seconds'.  Returns a timer that can be cancelled.
+function gs.after(seconds, fn)
+    local timer = gsn.timer(seconds, 0)
+    gs.timers[timer] = { fn = fn, periodic = false }
+    return timer
+end
+
+-- Call 'fn' every 'seconds', at a fixed rate, until cancelled.  If gs.poll
+-- isn't called often enough, missed calls are skipped rather than made late
+-- in a burst.  Returns the timer.
+function gs.every(seconds, fn)
+    local timer = gsn.timer(seconds, seconds)
+    gs.timers[timer] = { fn = fn, periodic = true }
+    return timer
+end
+
+-- Cancel a timer created by gs.after or gs.every.
+function gs.cancel(timer)
+    if gs.timers[timer] then
+        gs.timers[timer] = nil
+        gsn.timer_cancel(timer)
+    end
+end
+
+-- Send writes to 'tab' at a fixed rate of 'hz' ticks per second, instead of
+-- as they happen.  The writes made between ticks are sent together as one
+-- transaction frame, with only the last value of each field.  A rate of nil
+-- or 0 sends writes immediately again.
+function gs.rate(tab, hz)
+    local mt = gs.meta[tab]
+    assert(mt, 'not a gamesync table')
+    if mt.timer then
+        gs.cancel(mt.timer)
+        mt.timer = nil
+        mt:tick()
+    end
+    if hz and hz > 0 then
+        mt.timer = gs.every(1/hz, function() mt:tick() end)
+    end
+end
+
+-- Send heartbeats on connections that have been quiet for gs.heartbeat
+-- seconds, and drop connections that haven't received anything for
+-- gs.idle_timeout seconds, or that haven't connected in that time.  Accepted
+-- connections are closed; the peer reconnects.  Other connections reconnect,
+-- and send their tables again once they do.
+function gs.check_idle()
+    local now = gsn.now()
+    for name, sd in pairs(gs.socket) do
+        local state = gsn.state(sd.sd)
+        if sd.stale or (state ~= 'idle' and state ~= 'connecting') then
+            -- Listening, or already waiting to reconnect
+        elseif gs.idle_timeout and now-sd.last_recv > gs.idle_timeout then
+            if sd.accepted then
+                sd:close()
+                gs.socket[name] = nil
+            else
+                sd.stale = true
+                sd:reconnect_later()
+            end
+        elseif gs.heartbeat and sd.connected and now-sd.last_send > gs.heartbeat then
+            sd:heartbeat()
+        end
+    end
+end
+
+-- Call the callbacks of the timers that are due.
+function gs.expire()
+    for _, timer in ipairs(gsn.expire()) do
+        local entry = gs.timers[timer]
+        if entry and not entry.periodic then
+            gs.timers[timer] = nil
+            gsn.timer_cancel(timer)
+        end
+        if entry then
+            entry.fn()
+        end
+    end
+end
+
 function gs.close(src)
 
 end
 
 function gs.poll(wait) 
     local newsockets = {}
-    gsn.poll(gs.socket, wait)
+    if not gs.keepalive and (gs.heartbeat or gs.idle_timeout) then
+        gs.keepalive = gs.every(gs.keepalive_period, gs.check_idle)
+    end
+    gs.send_arrays()
     for _, sd in pairs(gs.socket) do
-        --if gsn.status(sd.sd) ~= 0 then
-        --    sd:connect(sd.host, sd.port)
-        --
-        print(gsn.state(sd.sd))
-        if gsn.state(sd.sd) == 'listening' then
+        -- Start on pending frames and streams before blocking, so that the
+        -- poll waits for the socket to drain rather than for the next timer
+        if sd.connected and not sd.stale then
+            sd:send_queue()
+            sd:send_streams()
+        end
+    end
+    gsn.poll(gs.socket, wait)
+    gs.expire()
+    for name, sd in pairs(gs.socket) do
+        local state = gsn.state(sd.sd)
+        if state == 'listening' then
             if gsn.readable(sd.sd) then
-                print('accept')
-                local ret = sd:accept()  
-                insert(newsockets, ret)
+                for _, ret in ipairs(sd:accept()) do
+                    insert(newsockets, ret)
+                end
+            end
+        elseif state ~= 'error' and state ~= 'closed' then
+            if state == 'idle' and not sd.connected then
+                sd.connected = true
+                sd.backoff = nil -- Connect confirmed; see gs_connected
+                if sd.stale then
+                    sd:resync()
+                end
             end
-        else
             if gsn.writable(sd.sd) then
-                print('writable')
-                gsn.send(sd.sd)
+                gsn.flush(sd.sd)
             end
+            sd:send_queue()
+            sd:send_streams()
             if gsn.readable(sd.sd) then
-                print('readable')
-                gsn.fetch(sd.sd)
-                sd:recv()
+                -- Keep reading while the socket has data, up to a limit, so
+                -- that a large value doesn't take one poll per buffer
+                local total = 0
+                repeat
+                    local len = gsn.fetch(sd.sd)
+                    if len > 0 then
+                        sd.last_recv = gsn.now()
+                    end
+                    total = total+len
+                    while sd:recv() do end
+                until len == 0 or total >= gs.read_limit
             end
+            state = gsn.state(sd.sd) -- Handle a close seen by this poll now
+        end
+        if (state == 'error' or state == 'closed') and sd.accepted then
+            sd:close() -- Accepted connection; the peer reconnects to a new one
+            gs.socket[name] = nil
+        elseif state == 'error' or state == 'closed' then
+            sd.stale = true -- Skip writes until gs.Socket:resync
+            sd:reconnect_later()
         end
     end
     for k, sd in ipairs(newsockets) do
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks packed arrays without a connection: the dirty range of an array is
+ * written to one socket's buffer, copied into another socket's read buffer,
+ * and patched into a second array.  Array headers that are invalid, or claim
+ * more elements than the read buffer holds, must be rejected rather than
+ * read. */
+
+#include "gamesync.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+static void expect(bool ok, char const* what) {
+    if (!ok) {
+        fprintf(stderr, "error: %s\n", what);
+        exit(1);
+    }
+}
+
+static gs_Array* newarray(gs_ArrayType type, int32_t len) {
+    gs_Array* arr = (gs_Array*)malloc(gs_array_size(type, len));
+    gs_array_init(arr, type, len);
+    gs_array_clean(arr);
+    return arr;
+}
+
+static void deliver(gs_Socket* from, gs_Socket* to) {
+    // Move the bytes written to 'from' into the read buffer of 'to'
+    size_t const len = from->write_ptr - from->write_buf;
+    memcpy(to->read_end, from->write_buf, len);
+    to->read_end += len;
+    from->write_ptr = from->write_buf;
+}
+
+static void header(gs_Socket* sd, char type, uint32_t len, uint32_t first, uint32_t count) {
+    // Write an array header straight into the read buffer
+    uint32_t const fields[3] = { htonl(len), htonl(first), htonl(count) };
+    *sd->read_end++ = type;
+    memcpy(sd->read_end, fields, sizeof(fields));
+    sd->read_end += sizeof(fields);
+}
+
+static void patch(gs_Socket* wr, gs_Socket* rd, gs_Array* arr, gs_Array* copy) {
+    // Send the dirty range of 'arr', and patch it into 'copy'
+    gs_send_begin(wr);
+    expect(gs_send_array(wr, arr, arr->dirty_first, arr->dirty_last-arr->dirty_first), "send");
+    expect(gs_send_end(wr), "send end");
+    deliver(wr, rd);
+    gs_ArrayPatch p;
+    gs_recv_begin(rd);
+    expect(gs_recv_array(rd, &p) == 1, "recv");
+    expect(gs_recv_end(rd), "recv end");
+    expect(p.type == arr->type && p.len == arr->len, "patch type");
+    expect(p.first == arr->dirty_first, "patch first");
+    expect(p.count == arr->dirty_last-arr->dirty_first, "patch count");
+    gs_array_patch(copy, &p);
+    gs_array_clean(arr);
+}
+
+static void dirty_ranges(gs_Socket* wr, gs_Socket* rd) {
+    gs_Array* arr = newarray(gs_f64, 100);
+    gs_Array* copy = newarray(gs_f64, 100);
+    gs_array_set(arr, 20, 2.5);
+    gs_array_set(arr, 10, 1.5);
+    expect(arr->dirty_first == 10 && arr->dirty_last == 21, "dirty range");
+    patch(wr, rd, arr, copy);
+    expect(gs_array_get(copy, 10) == 1.5 && gs_array_get(copy, 20) == 2.5, "patched");
+    expect(gs_array_get(copy, 9) == 0 && gs_array_get(copy, 21) == 0, "outside range");
+    expect(arr->dirty_first == arr->dirty_last, "clean");
+
+    gs_Array* ints = newarray(gs_i32, 7);
+    gs_Array* intcopy = newarray(gs_i32, 7);
+    gs_array_set(ints, 6, -7);
+    patch(wr, rd, ints, intcopy);
+    expect(gs_array_get(intcopy, 6) == -7 && gs_array_get(intcopy, 5) == 0, "i32 patch");
+
+    gs_Array* floats = newarray(gs_f32, 3);
+    gs_Array* floatcopy = newarray(gs_f32, 3);
+    gs_array_touch(floats);
+    gs_array_set(floats, 1, 0.25);
+    patch(wr, rd, floats, floatcopy);
+    expect(gs_array_get(floatcopy, 1) == 0.25f, "f32 patch");
+    free(arr);
+    free(copy);
+    free(ints);
+    free(intcopy);
+    free(floats);
+    free(floatcopy);
+}
+
+static void reject(gs_Socket* rd, char type, uint32_t len, uint32_t first, uint32_t count, char const* what) {
+    // Check that the header is rejected, and that nothing is consumed
+    gs_ArrayPatch p;
+    header(rd, type, len, first, count);
+    gs_recv_begin(rd);
+    expect(gs_recv_array(rd, &p) == -1, what);
+    expect(!gs_recv_end(rd), what);
+    expect(rd->read_ptr == rd->read_buf, what);
+    rd->read_end = rd->read_buf;
+}
+
+static void bad_headers(gs_Socket* rd) {
+    reject(rd, 'q', 4, 0, 4, "unknown type");
+    reject(rd, 'd', 4, 2, 3, "range past the end");
+    reject(rd, 'd', 0x80000000, 0, 0, "negative length");
+    reject(rd, 'd', 4, 0xffffffff, 1, "negative first");
+    reject(rd, 'i', 0x7fffffff, 0, 0x7fffffff, "more elements than the buffer");
+    reject(rd, 'd', 1 << 20, 0, gs_bufsize/sizeof(double)+1, "more bytes than the buffer");
+
+    // A valid header whose elements haven't all arrived waits for the rest
+    gs_ArrayPatch p;
+    header(rd, 'd', 4, 0, 4);
+    rd->read_end += 2*sizeof(double);
+    gs_recv_begin(rd);
+    expect(gs_recv_array(rd, &p) == 0, "incomplete");
+    expect(!gs_recv_end(rd), "incomplete end");
+    expect(rd->read_ptr == rd->read_buf, "incomplete rewind");
+    rd->read_end = rd->read_buf;
+}
+
+int main() {
+    gs_Socket* wr = gs_socket();
+    gs_Socket* rd = gs_socket();
+    dirty_ranges(wr, rd);
+    bad_headers(rd);
+    gs_close(wr);
+    gs_close(rd);
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks that the server never observes a half-applied gs.atomic block: each
+ * block sets t.k and fields f1..fn of the table to the same value, and the
+ * server checks that they agree after every poll.  Some blocks are larger than
+ * the write buffer, so they are sent in parts; one carries a string that is
+ * streamed ahead of the frame. */
+
+#include "Harness.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+static gs_Time const timeout = 10000000;
+static int const blocks[] = { 10, 5000, 10, 3000, 20000 };
+static int const nblocks = sizeof(blocks)/sizeof(blocks[0]);
+
+static void server() {
+    // Poll until the last block arrives, checking each block arrives whole
+    lua_State* env = newstate();
+    run(env, "gs = require('src.gamesync')");
+    run(env, "gs.listen("+std::to_string(port)+")");
+    run(env,
+        "function consistent(t)"
+        "    if not t.n then return false end"
+        "    for i = 1, t.n do"
+        "        if t['f'..i] ~= t.k then return false end"
+        "    end"
+        "    return t.k ~= 4 or t.s == string.rep('s', 100000)"
+        " end");
+    gs_Time const deadline = gs_now()+timeout;
+    while (gs_now() < deadline) {
+        run(env, "gs.poll(false)");
+        if (!check(env, "not gs.table['/test'] or not gs.table['/test'].k")) {
+            if (!check(env, "consistent(gs.table['/test'])")) {
+                fprintf(stderr, "error: saw a half-applied block\n");
+                _exit(1);
+            }
+            if (check(env, "gs.table['/test'].k == "+std::to_string(nblocks))) {
+                _exit(0);
+            }
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "error: server never saw the last block\n");
+    _exit(1);
+}
+
+int main() {
+    pid_t const pid = fork();
+    if (pid == 0) {
+        server();
+    }
+
+    lua_State* env = newstate();
+    run(env, "gs = require('src.gamesync')");
+    run(env, "gs.backoff_min = 0.01 gs.backoff_max = 0.1");
+    run(env, "t = gs.open('gs://127.0.0.1:"+std::to_string(port)+"/test')");
+    for (int k = 1; k <= nblocks; ++k) {
+        std::string const n = std::to_string(blocks[k-1]);
+        run(env,
+            "gs.atomic(function()"
+            "    t.k = "+std::to_string(k)+
+            "    t.n = "+n+
+            "    for i = 1, "+n+" do t['f'..i] = "+std::to_string(k)+" end"
+            "    if t.k == 4 then t.s = string.rep('s', 100000) end"
+            " end)");
+        for (int i = 0; i < 5; ++i) {
+            run(env, "gs.poll(false)");
+            usleep(1000);
+        }
+    }
+
+    gs_Time const deadline = gs_now()+timeout;
+    int status = 0;
+    while (waitpid(pid, &status, WNOHANG) != pid) {
+        if (gs_now() > deadline) {
+            fprintf(stderr, "error: server timed out\n");
+            kill(pid, SIGKILL);
+            return 1;
+        }
+        run(env, "gs.poll(false)");
+        usleep(1000);
+    }
+    lua_close(env);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Helpers shared by the tests and tools that drive the Lua module.  Run them
+ * from the root of the repository, so that require('src.gamesync') finds the
+ * module. */
+
+#pragma once
+
+#include "gamesync.h"
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+int luaopen_lib_gamesync(lua_State* env);
+}
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+/* Loopback port, picked per process so that concurrent runs don't collide */
+static int const port = 20000 + getpid() % 10000;
+
+/* Creates a Lua state in which require('lib.gamesync') loads the bindings
+ * linked into this program */
+inline lua_State* newstate() {
+    lua_State* env = luaL_newstate();
+    luaL_openlibs(env);
+    lua_getglobal(env, "package");
+    lua_getfield(env, -1, "preload");
+    lua_pushcfunction(env, luaopen_lib_gamesync);
+    lua_setfield(env, -2, "lib.gamesync");
+    lua_pop(env, 2);
+    return env;
+}
+
+/* Runs 'code', and exits with the error if it raises */
+inline void run(lua_State* env, std::string const& code) {
+    if (luaL_dostring(env, code.c_str())) {
+        fprintf(stderr, "error: %s\n", lua_tostring(env, -1));
+        exit(1);
+    }
+}
+
+/* Returns true if the Lua expression 'expr' is true */
+inline bool check(lua_State* env, std::string const& expr) {
+    run(env, "return "+expr);
+    bool const ret = lua_toboolean(env, -1);
+    lua_settop(env, 0);
+    return ret;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks that a client sends its tables again after the server restarts: the
+ * client writes x and y to server A, A exits, the client writes z while it is
+ * disconnected, and server B, listening on the same port, must end up with a
+ * copy of the table holding x, y and z. */
+
+#include "Harness.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+static gs_Time const timeout = 5000000;
+
+static void server(std::string const& expr) {
+    // Listen until the table received from the client satisfies 'expr'
+    lua_State* env = newstate();
+    run(env, "gs = require('src.gamesync')");
+    run(env, "gs.listen("+std::to_string(port)+")");
+    gs_Time const deadline = gs_now()+timeout;
+    while (gs_now() < deadline) {
+        run(env, "gs.poll(false)");
+        if (check(env, "gs.table['/test'] and "+expr)) {
+            _exit(0);
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "error: server never saw %s\n", expr.c_str());
+    _exit(1);
+}
+
+static pid_t spawn(std::string const& expr) {
+    pid_t const pid = fork();
+    if (pid == 0) {
+        server(expr);
+    }
+    return pid;
+}
+
+static void wait_for(lua_State* env, pid_t pid) {
+    // Poll the client until the server exits, and check that it succeeded
+    gs_Time const deadline = gs_now()+timeout;
+    int status = 0;
+    while (waitpid(pid, &status, WNOHANG) != pid) {
+        if (gs_now() > deadline) {
+            fprintf(stderr, "error: server timed out\n");
+            kill(pid, SIGKILL);
+            exit(1);
+        }
+        run(env, "gs.poll(false)");
+        usleep(10000);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        exit(1);
+    }
+}
+
+int main() {
+    pid_t const a = spawn("gs.table['/test'].x == 1 and gs.table['/test'].y == 'two'");
+
+    lua_State* env = newstate();
+    run(env, "gs = require('src.gamesync')");
+    run(env, "gs.backoff_min = 0.01 gs.backoff_max = 0.1");
+    run(env, "t = gs.open('gs://127.0.0.1:"+std::to_string(port)+"/test')");
+    run(env, "sd = gs.socket['127.0.0.1:"+std::to_string(port)+"']");
+    run(env, "t.x = 1 t.y = 'two'");
+    wait_for(env, a);
+
+    // Server A is gone; write while the client is disconnected
+    gs_Time const deadline = gs_now()+timeout;
+    while (!check(env, "sd.stale")) {
+        if (gs_now() > deadline) {
+            fprintf(stderr, "error: client never saw the server exit\n");
+            return 1;
+        }
+        run(env, "gs.poll(false)");
+        usleep(10000);
+    }
+    run(env, "t.z = 3");
+
+    pid_t const b = spawn("gs.table['/test'].x == 1 and gs.table['/test'].y == 'two' and gs.table['/test'].z == 3");
+    wait_for(env, b);
+    lua_close(env);
+    return 0;
+}
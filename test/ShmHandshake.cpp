@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks that the shm:// listener rejects bad handshakes cleanly: peers that
+ * hang up, send no fds, too few fds, a segment too small for the rings, or a
+ * segment that isn't sealed against shrinking.  None of them may be accepted
+ * or leak the fds they sent, and a peer that connects and sends nothing must
+ * not keep a good peer from being accepted.  The shared memory transport
+ * only exists on Linux. */
+
+#include "gamesync.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static std::string const name = "gamesync-test-" + std::to_string(getpid());
+
+static void expect(bool ok, char const* what) {
+    if (!ok) {
+        fprintf(stderr, "error: %s\n", what);
+        exit(1);
+    }
+}
+
+static int openfds() {
+    // Returns the number of fds open in this process
+    int n = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    while (readdir(dir)) {
+        n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+static int dial() {
+    // Connect to the listener the way gs_shm_connect does, without the fds
+    int const sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path+1, sizeof(sun.sun_path)-1, "gamesync/%s", name.c_str());
+    socklen_t const len = offsetof(struct sockaddr_un, sun_path)+1+strlen(sun.sun_path+1);
+    expect(connect(sd, (struct sockaddr*)&sun, len) == 0, "connect");
+    return sd;
+}
+
+static void sendfds(int sd, int const* fds, int n) {
+    // Send one byte, with 'n' fds attached if 'n' is non-zero
+    char cmsgbuf[CMSG_SPACE(3*sizeof(int))];
+    char byte = 0;
+    struct iovec iov = { &byte, sizeof(byte) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsgbuf, 0, sizeof(cmsgbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n) {
+        msg.msg_control = cmsgbuf;
+        msg.msg_controllen = CMSG_SPACE(n*sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n*sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n*sizeof(int));
+    }
+    expect(sendmsg(sd, &msg, 0) == 1, "sendmsg");
+}
+
+static void handshake(size_t size, bool seal, int n) {
+    // Send a segment of 'size' bytes and two eventfds, keeping the first 'n'
+    int fds[3];
+    fds[0] = memfd_create("gamesync-test", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    expect(ftruncate(fds[0], size) == 0, "ftruncate");
+    if (seal) {
+        expect(fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK) == 0, "seal");
+    }
+    int const sd = dial();
+    sendfds(sd, fds, n);
+    for (int i = 0; i < 3; ++i) {
+        close(fds[i]);
+    }
+    close(sd);
+}
+
+static void rejected(gs_Socket* ls, char const* what) {
+    // Poll until the listener has dropped the handshake, which must fail
+    for (int i = 0; i < 100 && (i == 0 || ls->pending); ++i) {
+        gs_poll(&ls, 1, 0);
+        gs_Socket* sd = gs_accept(ls);
+        expect(!sd, what);
+    }
+    expect(!ls->pending, what);
+}
+
+int main() {
+    gs_Socket* ls = gs_shm_socket();
+    gs_shm_listen(ls, name.c_str(), 0);
+    expect(ls->state == gs_listening, "listen");
+    int const baseline = openfds();
+
+    close(dial());
+    rejected(ls, "peer that hung up");
+
+    int const silent = dial();
+    sendfds(silent, 0, 0);
+    rejected(ls, "no fds");
+    close(silent);
+
+    handshake(2*sizeof(gs_Ring), true, 1);
+    rejected(ls, "one fd");
+
+    handshake(4096, true, 3);
+    rejected(ls, "short segment");
+
+    handshake(2*sizeof(gs_Ring), false, 3);
+    rejected(ls, "unsealed segment");
+
+    expect(openfds() == baseline, "leaked fds");
+
+    // A peer that sends nothing waits on the pending list, and doesn't keep a
+    // good peer from being accepted
+    int const idle = dial();
+    gs_Socket* client = gs_shm_socket();
+    gs_shm_connect(client, name.c_str());
+    expect(client->state == gs_idle, "good connect");
+    gs_Socket* server = 0;
+    for (int i = 0; i < 100 && !server; ++i) {
+        gs_poll(&ls, 1, 0);
+        server = gs_accept(ls);
+    }
+    expect(server && server->state == gs_idle, "good accept");
+    expect(ls->pending != 0, "idle peer pending");
+    close(idle);
+    rejected(ls, "idle peer");
+
+    gs_send_begin(client);
+    gs_send_id(client, 42);
+    expect(gs_send_end(client), "send");
+    gs_flush(client);
+    gs_poll(&server, 1, 0);
+    expect(gs_fetch(server) > 0, "fetch");
+    gs_recv_begin(server);
+    expect(gs_recv_id(server) == 42 && gs_recv_end(server), "recv");
+
+    gs_close(client);
+    gs_close(server);
+    gs_close(ls);
+    return 0;
+}
+#else
+int main() {
+    return 0;
+}
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Compares the shared memory transport with TCP loopback.  A forked server
+ * echoes small messages, for round-trip latency, and counts a stream of
+ * one-way messages, for throughput.  CPU time is the user+system time of both
+ * processes over the whole run, divided by the number of messages.
+ *
+ * usage: gamesync-shm [round trips] [megabytes] (default: 20000 256) */
+
+#include "gamesync.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum Message { ping = 1, bulk = 2, done = 3 };
+
+static int const port = 20000 + getpid() % 10000;
+static std::string const name = "gamesync-bench-" + std::to_string(getpid());
+static int32_t const bulksize = 1024;
+
+static void check(gs_Socket* sd) {
+    if (sd->state == gs_error || sd->state == gs_closed) {
+        fprintf(stderr, "error: %s\n", gs_strerror(sd->status));
+        exit(1);
+    }
+}
+
+static void send_msg(gs_Socket* sd, gs_Id id, char const* buf, int32_t len) {
+    // Waits until the message fits in the write buffer
+    for (;;) {
+        gs_send_begin(sd);
+        gs_send_id(sd, id);
+        gs_send_buf(sd, buf, len);
+        if (gs_send_end(sd)) {
+            return;
+        }
+        int32_t const space = gs_send_space(sd);
+        gs_flush(sd);
+        if (gs_send_space(sd) == space) {
+            gs_poll(&sd, 1, 1); // Wait for the write buffer to drain
+        }
+        check(sd);
+    }
+}
+
+static gs_Id recv_msg(gs_Socket* sd) {
+    // Waits for the next message, and returns its id
+    for (;;) {
+        int32_t len = 0;
+        gs_recv_begin(sd);
+        gs_Id const id = gs_recv_id(sd);
+        gs_recv_buf(sd, &len);
+        if (gs_recv_end(sd)) {
+            return id;
+        }
+        gs_flush(sd);
+        gs_poll(&sd, 1, 1);
+        gs_fetch(sd);
+        check(sd);
+    }
+}
+
+static void server(gs_Socket* ls) {
+    // Accept one connection, and answer it until it closes
+    gs_Socket* sds[] = { ls, 0 };
+    while (!sds[1]) {
+        gs_poll(sds, 1, 1);
+        sds[1] = gs_accept(ls);
+    }
+    gs_Socket* sd = sds[1];
+    for (;;) {
+        gs_poll(&sd, 1, 1);
+        gs_fetch(sd);
+        for (;;) {
+            int32_t len = 0;
+            gs_recv_begin(sd);
+            gs_Id const id = gs_recv_id(sd);
+            char const* buf = gs_recv_buf(sd, &len);
+            if (!gs_recv_end(sd)) {
+                break;
+            } else if (id == ping) {
+                send_msg(sd, ping, buf, len);
+            } else if (id == done) {
+                send_msg(sd, done, 0, 0);
+            }
+        }
+        gs_flush(sd);
+        if (sd->state == gs_error || sd->state == gs_closed) {
+            _exit(0);
+        }
+    }
+}
+
+static gs_Socket* connect_to(bool shm) {
+    // Connects to the server, retrying until it is listening
+    for (;;) {
+        gs_Socket* sd = shm ? gs_shm_socket() : gs_socket();
+        if (shm) {
+            gs_shm_connect(sd, name.c_str());
+        } else {
+            gs_connect(sd, "127.0.0.1", port);
+        }
+        while (sd->state == gs_connecting) {
+            gs_poll(&sd, 1, 1);
+        }
+        if (sd->state == gs_idle) {
+            return sd;
+        }
+        gs_close(sd);
+        usleep(10000);
+    }
+}
+
+static double cpu(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void bench(bool shm, int trips, int mb) {
+    double const cpu0 = cpu(RUSAGE_SELF) + cpu(RUSAGE_CHILDREN);
+    pid_t const pid = fork();
+    if (pid == 0) {
+        gs_Socket* ls = shm ? gs_shm_socket() : gs_socket();
+        if (shm) {
+            gs_shm_listen(ls, name.c_str(), 0);
+        } else {
+            gs_listen(ls, port, 0);
+        }
+        check(ls);
+        server(ls);
+    }
+    gs_Socket* sd = connect_to(shm);
+
+    std::vector<gs_Time> rtt;
+    char buf[bulksize] = { 0 };
+    for (int i = 0; i < trips; ++i) {
+        gs_Time const start = gs_now();
+        send_msg(sd, ping, buf, 16);
+        gs_flush(sd);
+        while (recv_msg(sd) != ping) {}
+        rtt.push_back(gs_now()-start);
+    }
+
+    int const count = (mb << 20) / bulksize;
+    gs_Time const start = gs_now();
+    for (int i = 0; i < count; ++i) {
+        send_msg(sd, bulk, buf, bulksize);
+    }
+    send_msg(sd, done, 0, 0);
+    gs_flush(sd);
+    while (recv_msg(sd) != done) {}
+    double const secs = (gs_now()-start)/1e6;
+
+    gs_close(sd);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    double const used = cpu(RUSAGE_SELF) + cpu(RUSAGE_CHILDREN) - cpu0;
+
+    std::sort(rtt.begin(), rtt.end());
+    gs_Time total = 0;
+    for (gs_Time t : rtt) {
+        total += t;
+    }
+    printf("%-6s %10.1f %10.1f %10.1f %10.1f %10.2f\n", shm ? "shm" : "tcp",
+        (double)total/rtt.size(), (double)rtt[rtt.size()/2],
+        (double)rtt[rtt.size()*99/100], mb/secs, used*1e6/(trips*2+count));
+}
+
+int main(int argc, char** argv) {
+    int const trips = argc > 1 ? atoi(argv[1]) : 20000;
+    int const mb = argc > 2 ? atoi(argv[2]) : 256;
+    printf("%-6s %10s %10s %10s %10s %10s\n", "", "rtt us", "p50 us", "p99 us",
+        "MB/s", "cpu us/msg");
+    bench(false, trips, mb);
+    bench(true, trips, mb);
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Simulates a reconnect storm after a server restart: N clients connect to a
+ * forked server at once, and each sends one message.  The time is taken from
+ * the first connect until the server has received the message of every
+ * client.  Clients that fail to connect retry after 0.1s, doubling up to 1s,
+ * like gs.Socket:reconnect_later.  A backlog of 0 uses SOMAXCONN; with a
+ * backlog smaller than the storm, the kernel drops SYNs and the clients wait
+ * on its retransmit timer (1s, then doubling).
+ *
+ * usage: gamesync-storm [clients] [backlog...] (default: 1000 0 128 32) */
+
+#include "gamesync.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int const port = 20000 + getpid() % 10000;
+static gs_Id const hello = 1;
+static gs_Time const timeout = 120000000;
+
+struct Client {
+    gs_Socket* sd;
+    gs_Time retry; /* time of the next connect attempt, if not connected */
+    gs_Time backoff;
+};
+
+static void server(int nclients, int backlog) {
+    // Accept clients until every one of them has sent its message
+    gs_reserve(nclients);
+    gs_Socket* ls = gs_socket();
+    gs_listen(ls, port, backlog);
+    if (ls->state != gs_listening) {
+        fprintf(stderr, "error: %s\n", gs_strerror(ls->status));
+        _exit(1);
+    }
+    std::vector<gs_Socket*> sds = { ls };
+    int synced = 0;
+    while (synced < nclients) {
+        gs_poll(sds.data(), (int)sds.size(), 1);
+        while (gs_Socket* sd = gs_accept(ls)) {
+            sds.push_back(sd);
+        }
+        for (size_t i = 1; i < sds.size(); ++i) {
+            gs_Socket* sd = sds[i];
+            if (!(sd->flags & gs_read)) {
+                continue;
+            }
+            gs_fetch(sd);
+            gs_recv_begin(sd);
+            gs_Id const id = gs_recv_id(sd);
+            if (gs_recv_end(sd) && id == hello) {
+                synced++;
+            }
+        }
+    }
+    _exit(0);
+}
+
+static void reconnect(Client* client) {
+    if (client->sd) {
+        gs_close(client->sd);
+    }
+    client->sd = gs_socket();
+    gs_connect(client->sd, "127.0.0.1", port);
+    gs_send_begin(client->sd);
+    gs_send_id(client->sd, hello);
+    gs_send_end(client->sd); // Sent once the connect completes
+}
+
+static void bench(int nclients, int backlog) {
+    pid_t const pid = fork();
+    if (pid == 0) {
+        server(nclients, backlog);
+    }
+    usleep(200000); // Let the server start listening
+
+    std::vector<Client> clients(nclients);
+    std::vector<gs_Socket*> sds(nclients);
+    gs_Timer* tick = gs_timer(10000, 10000); // Wakes gs_poll for retries
+    int retries = 0;
+    int status = 0;
+    gs_Time const start = gs_now();
+    for (Client& client : clients) {
+        client.sd = 0;
+        client.backoff = 100000;
+        client.retry = gs_never;
+        reconnect(&client);
+    }
+    while (waitpid(pid, &status, WNOHANG) != pid) {
+        gs_Time const now = gs_now();
+        if (now > start+timeout) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            break;
+        }
+        for (int i = 0; i < nclients; ++i) {
+            Client& client = clients[i];
+            if (client.retry <= now) {
+                reconnect(&client);
+                client.retry = gs_never;
+                retries++;
+            }
+            sds[i] = client.sd;
+        }
+        gs_poll(sds.data(), nclients, 1);
+        while (gs_timer_expire()) {}
+        for (Client& client : clients) {
+            if (client.sd->flags & gs_write) {
+                gs_flush(client.sd);
+            }
+            if (client.sd->state == gs_error && client.retry == gs_never) {
+                client.retry = gs_now()+client.backoff;
+                client.backoff = client.backoff*2 < 1000000 ? client.backoff*2 : 1000000;
+            }
+        }
+    }
+    double const secs = (gs_now()-start)/1e6;
+    gs_timer_cancel(tick);
+    for (Client& client : clients) {
+        gs_close(client.sd);
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL) {
+        printf("%10d %10d %10s %10d\n", nclients, backlog, "timeout", retries);
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        exit(1);
+    } else {
+        printf("%10d %10d %10.1f %10d\n", nclients, backlog, secs*1e3, retries);
+    }
+}
+
+int main(int argc, char** argv) {
+    int const nclients = argc > 1 ? atoi(argv[1]) : 1000;
+    std::vector<int> backlogs;
+    for (int i = 2; i < argc; ++i) {
+        backlogs.push_back(atoi(argv[i]));
+    }
+    if (backlogs.empty()) {
+        backlogs = { 0, 128, 32 };
+    }
+    setvbuf(stdout, 0, _IOLBF, 0);
+    printf("%10s %10s %10s %10s\n", "clients", "backlog", "ms", "retries");
+    for (int backlog : backlogs) {
+        bench(nclients, backlog);
+    }
+    return 0;
+}
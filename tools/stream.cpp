@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures the throughput of large string values, which are streamed in
+ * fragments of gs.chunk_size bytes.  A forked server listens on loopback;
+ * the client writes one string of each size to a table, and the time is taken
+ * from the write until the server has the whole string.  Run from the root of
+ * the repository, so that require('src.gamesync') finds the Lua module.
+ *
+ * usage: gamesync-stream [megabytes...] (default: 1 4 16 64) */
+
+#include "Harness.hpp"
+
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+
+static gs_Time const timeout = 60000000;
+
+static void server(int len) {
+    // Listen until the string arrives, then exit
+    lua_State* env = newstate();
+    run(env, "gs = require('src.gamesync')");
+    run(env, "gs.listen("+std::to_string(port)+")");
+    std::string const expr = "gs.table['/bench'] and #(gs.table['/bench'].blob or '') == "+std::to_string(len);
+    gs_Time const deadline = gs_now()+timeout;
+    while (gs_now() < deadline) {
+        run(env, "gs.poll(true)");
+        if (check(env, expr)) {
+            _exit(0);
+        }
+    }
+    _exit(1);
+}
+
+static double bench(int len) {
+    // Returns the time taken to send a string of 'len' bytes, in seconds
+    pid_t const pid = fork();
+    if (pid == 0) {
+        server(len);
+    }
+    lua_State* env = newstate();
+    run(env, "gs = require('src.gamesync')");
+    run(env, "gs.backoff_min = 0.01 gs.backoff_max = 0.01");
+    run(env, "t = gs.open('gs://127.0.0.1:"+std::to_string(port)+"/bench')");
+    run(env, "sd = gs.socket['127.0.0.1:"+std::to_string(port)+"']");
+    run(env, "blob = string.rep('x', "+std::to_string(len)+")");
+    while (!check(env, "sd.connected and not sd.stale")) {
+        run(env, "gs.poll(true)");
+    }
+
+    gs_Time const start = gs_now();
+    run(env, "t.blob = blob");
+    int status = 0;
+    while (waitpid(pid, &status, WNOHANG) != pid) {
+        if (gs_now() > start+timeout) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            break;
+        }
+        run(env, "gs.poll(true)");
+    }
+    gs_Time const end = gs_now();
+    lua_close(env);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "error: the server didn't receive %d bytes\n", len);
+        exit(1);
+    }
+    return (end-start)/1e6;
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; ++i) {
+        sizes.push_back(atoi(argv[i]));
+    }
+    if (sizes.empty()) {
+        sizes = { 1, 4, 16, 64 };
+    }
+    printf("%10s %10s %10s\n", "MB", "ms", "MB/s");
+    for (int mb : sizes) {
+        double const secs = bench(mb << 20);
+        printf("%10d %10.1f %10.1f\n", mb, secs*1e3, mb/secs);
+    }
+    return 0;
+}
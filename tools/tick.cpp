@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2014 Matt Fichman
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, APEXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Compares fixed-rate ticks driven by a periodic gs_timer, with gs_poll
+ * waiting for the next deadline, against the spin loop that was needed
+ * before: gs_poll without waiting, checking the clock on every pass.  Reports
+ * the CPU used, as a percentage of one core, and how late each tick ran after
+ * its ideal time (start + k*period).  Ticks more than a period late count as
+ * missed.  Timer deadlines are rounded up to the 1ms tick of the timer wheel,
+ * so timer ticks run up to 1ms late even on an idle machine.
+ *
+ * usage: gamesync-tick [seconds] [hz...] (default: 5 20 60 120) */
+
+#include "gamesync.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/resource.h>
+
+struct Result {
+    std::vector<gs_Time> late;
+    int missed;
+    double cpu;
+};
+
+static double cpu() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void record(Result* result, gs_Time* next, gs_Time period) {
+    // Record how late the tick due at 'next' ran, and skip missed deadlines
+    gs_Time const now = gs_now();
+    while (now >= *next + period) {
+        *next += period;
+        result->missed++;
+    }
+    result->late.push_back(now - *next);
+    *next += period;
+}
+
+static Result bench(bool spin, double secs, int hz) {
+    gs_Time const period = 1000000 / hz;
+    Result result;
+    result.missed = 0;
+    double const cpu0 = cpu();
+    gs_Time const start = gs_now();
+    gs_Time const end = start + (gs_Time)(secs*1e6);
+    if (spin) {
+        gs_Time next = start + period;
+        while (next < end) {
+            gs_poll(0, 0, 0);
+            if (gs_now() >= next) {
+                record(&result, &next, period);
+            }
+        }
+    } else {
+        // Ticks are measured against the deadline the timer fired for, which
+        // gs_timer_expire advances past any deadlines it skipped
+        gs_Timer* timer = gs_timer(period, period);
+        while (timer->deadline < end) {
+            gs_poll(0, 0, 1);
+            gs_Time const due = timer->deadline;
+            if (gs_timer_expire() == timer) {
+                result.late.push_back(gs_now() - due);
+                result.missed += (int)((timer->deadline - due) / period) - 1;
+            }
+        }
+        gs_timer_cancel(timer);
+    }
+    result.cpu = (cpu() - cpu0) / ((gs_now() - start) / 1e6);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    double const secs = argc > 1 ? atof(argv[1]) : 5;
+    std::vector<int> rates;
+    for (int i = 2; i < argc; ++i) {
+        rates.push_back(atoi(argv[i]));
+    }
+    if (rates.empty()) {
+        rates = { 20, 60, 120 };
+    }
+    printf("%-6s %6s %8s %8s %8s %10s %10s %10s\n", "", "hz", "ticks", "missed",
+        "cpu %", "mean us", "p99 us", "max us");
+    for (int hz : rates) {
+        for (int spin = 0; spin < 2; ++spin) {
+            Result r = bench(spin, secs, hz);
+            std::sort(r.late.begin(), r.late.end());
+            gs_Time total = 0;
+            for (gs_Time t : r.late) {
+                total += t;
+            }
+            printf("%-6s %6d %8zu %8d %8.1f %10.1f %10.1f %10.1f\n",
+                spin ? "spin" : "timer", hz, r.late.size(), r.missed, r.cpu*100,
+                (double)total/r.late.size(), (double)r.late[r.late.size()*99/100],
+                (double)r.late.back());
+        }
+    }
+    return 0;
+}